@@ -0,0 +1,265 @@
+/*
+ * misc/framebench.c from hirc - time splitting server input into lines.
+ *
+ * Copyright (c) 2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * usage: framebench [-n runs] [-c chunk] [capture...]
+ *
+ * Feeds captures of raw server input (bouncer playback saved with
+ * socat, say) through both the framing serv_read() used to do, looking
+ * for "\r\n" with strstr() in a buffer that grows as needed, and the
+ * ring in src/input.c that it uses now. Each is handed chunk bytes at a
+ * time, as read(2) would. Without a capture, some megabytes of tagged
+ * chathistory playback are made up.
+ *
+ * The old framing is kept here, the ring is linked in from src/input.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "../src/hirc.h"
+
+#define INPUT_BUF_MIN 1024
+#define MADEUP (8 * 1024 * 1024)
+
+struct Result {
+	unsigned long lines;
+	unsigned long sum;
+};
+
+/* src/input.c wants it, and it's in src/mem.c with the rest of hirc */
+void *
+emalloc(size_t size) {
+	void *p;
+
+	if ((p = malloc(size)) == NULL) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+void *
+erealloc(void *p, size_t size) {
+	if ((p = realloc(p, size)) == NULL) {
+		perror("realloc()");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* Stands in for handle(): look at the line, so it can't be skipped */
+static void
+sink(struct Result *r, char *line) {
+	r->lines++;
+	r->sum += (unsigned char)*line;
+}
+
+/* serv_read() before the ring */
+static void
+frame_strstr(char *data, size_t size, size_t chunk, struct Result *r) {
+	char *buf, *line, *end;
+	size_t bufsize = INPUT_BUF_MIN, pos = 0, off = 0, ret;
+
+	buf = emalloc(bufsize);
+	while (off < size) {
+		ret = bufsize - pos - 1;
+		if (ret > chunk)
+			ret = chunk;
+		if (ret > size - off)
+			ret = size - off;
+		memcpy(&buf[pos], &data[off], ret);
+		off += ret;
+		pos += ret;
+
+		buf[pos] = '\0';
+		line = buf;
+		while ((end = strstr(line, "\r\n"))) {
+			*end = '\0';
+			sink(r, line);
+			line = end + 2;
+		}
+
+		pos -= line - buf;
+		memmove(buf, line, pos);
+
+		if (pos + ret > bufsize / 2) {
+			bufsize *= 2;
+			buf = erealloc(buf, bufsize);
+		} else if (pos + ret < bufsize / 2 && bufsize != INPUT_BUF_MIN) {
+			bufsize /= 2;
+			buf = erealloc(buf, bufsize);
+		}
+	}
+	free(buf);
+}
+
+/* serv_read() now: a readv(2) into the ring, then the lines in it */
+static void
+frame_ring(char *data, size_t size, size_t chunk, struct Result *r) {
+	struct Input in = {0};
+	struct iovec iov[2];
+	size_t off = 0, left, n;
+	char *line;
+	int iovcnt, i, ret;
+
+	serv_input_reset(&in);
+	while (off < size) {
+		iovcnt = serv_input_space(&in, iov);
+		for (i = 0, left = chunk; i < iovcnt && left && off < size; i++) {
+			n = iov[i].iov_len;
+			if (n > left)
+				n = left;
+			if (n > size - off)
+				n = size - off;
+			memcpy(iov[i].iov_base, &data[off], n);
+			off += n;
+			left -= n;
+			in.len += n;
+		}
+
+		while ((ret = serv_input_line(&in, &line)) != 0)
+			if (ret == 1)
+				sink(r, line);
+	}
+	free(in.buf);
+}
+
+static char *
+readfile(char *path, size_t *size) {
+	struct stat st;
+	char *data;
+	ssize_t ret;
+	size_t off;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	data = emalloc(st.st_size + 1);
+	for (off = 0; off < st.st_size; off += ret) {
+		if ((ret = read(fd, &data[off], st.st_size - off)) <= 0) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+	*size = st.st_size;
+	return data;
+}
+
+static char *
+makeup(size_t *size) {
+	char *data, text[512];
+	size_t off = 0;
+	int i, len;
+
+	data = emalloc(MADEUP + 1024);
+	for (i = 0; off < MADEUP; i++) {
+		len = 10 + (i * 37) % 300;
+		memset(text, 'a' + i % 26, len);
+		text[len] = '\0';
+		off += snprintf(&data[off], MADEUP + 1024 - off,
+				"@batch=ch;time=2022-01-%02dT%02d:%02d:%02d.000Z;msgid=%08x "
+				":nick%d!user@host.example PRIVMSG #channel :%s\r\n",
+				1 + i / 86400 % 28, i / 3600 % 24, i / 60 % 60, i % 60,
+				i, i % 50, text);
+	}
+	*size = off;
+	return data;
+}
+
+static double
+bench(char *name, void (*frame)(char *, size_t, size_t, struct Result *),
+		char *data, size_t size, size_t chunk, int runs) {
+	struct timespec start, end;
+	struct Result r;
+	double t, best = 0;
+	int i;
+
+	for (i = 0; i < runs; i++) {
+		memset(&r, 0, sizeof(r));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		frame(data, size, chunk, &r);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		if (!i || t < best)
+			best = t;
+	}
+	printf("  %-8s %9lu lines  %9.3f ms  %8.1f MiB/s  (sum %lu)\n", name, r.lines,
+			best * 1e3, size / best / (1024 * 1024), r.sum);
+	return best;
+}
+
+static void
+run(char *name, char *data, size_t size, size_t chunk, int runs) {
+	double old, new;
+
+	printf("%s: %.1f MiB, read %lu bytes at a time, best of %d\n",
+			name, size / (1024.0 * 1024.0), (unsigned long)chunk, runs);
+	old = bench("strstr", frame_strstr, data, size, chunk, runs);
+	new = bench("ring", frame_ring, data, size, chunk, runs);
+	printf("  ring is %.2fx strstr\n", old / new);
+}
+
+static void
+usage(char *argv0) {
+	fprintf(stderr, "usage: %s [-n runs] [-c chunk] [capture...]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[]) {
+	size_t chunk = 4096, size;
+	char *data;
+	int runs = 5, c;
+
+	while ((c = getopt(argc, argv, "n:c:")) != -1) {
+		switch (c) {
+		case 'n':
+			if ((runs = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			if ((chunk = strtoul(optarg, NULL, 10)) == 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		data = makeup(&size);
+		run("made up playback", data, size, chunk, runs);
+		free(data);
+	}
+	for (; optind < argc; optind++) {
+		data = readfile(argv[optind], &size);
+		run(argv[optind], data, size, chunk, runs);
+		free(data);
+	}
+	return 0;
+}
@@ -26,6 +26,7 @@ chan_free(struct Channel *channel) {
 	if (channel) {
 		pfree(&channel->name);
 		pfree(&channel->mode);
+		pfree(&channel->key);
 		nick_free_list(&channel->nicks);
 		pfree(&channel->nicks);
 		hist_free_list(channel->history);
@@ -59,15 +60,20 @@ chan_create(struct Server *server, char *name, int query) {
 	channel->name = name ? estrdup(name) : NULL;
 	channel->next = channel->prev = NULL;
 	channel->nicks = NULL;
-	channel->old = 0;
-	channel->mode = channel->topic = NULL;
+	channel->old = channel->rejoin = 0;
+	channel->mode = channel->topic = channel->key = NULL;
 	channel->query = query;
+	channel->fetch = Fetch_none;
+	channel->fetchedall = 0;
 	channel->server = server;
 	channel->history = emalloc(sizeof(struct HistInfo));
 	channel->history->activity = Activity_none;
 	channel->history->unread = channel->history->ignored = 0;
 	channel->history->server = server;
 	channel->history->channel = channel;
+	channel->history->oldest = channel->history->placed = NULL;
+	channel->history->len = 0;
+	channel->history->seen = NULL;
 	if (server)
 		channel->history->history = hist_loadlog(channel->history, server->name, name);
 	else
@@ -118,7 +124,7 @@ chan_get(struct Channel **head, char *name, int old) {
 		return NULL;
 
 	for (p = *head; p; p = p->next) {
-		if (strcmp(p->name, name) == 0 && (old < 0 || p->old == old))
+		if (serv_casecmp(p->server, p->name, name) == 0 && (old < 0 || p->old == old))
 			return p;
 	}
 
@@ -156,3 +162,92 @@ chan_remove(struct Channel **head, char *name) {
 	chan_free(p);
 	return 1;
 }
+
+/* Which of CHANMODES=A,B,C,D mode is in: 'A' for lists (always takes an
+ * argument, not kept in chan->mode), 'B' always takes one, 'C' only when
+ * set, 'D' never. 'P' for PREFIX modes, 0 if unknown. */
+static char
+chan_modetype(struct Server *server, char mode) {
+	return server->isupport.modetype[(unsigned char)mode];
+}
+
+/* The prefix PREFIX=(ov)@+ gives for mode */
+static char
+chan_modeprefix(struct Server *server, char mode) {
+	return server->isupport.modeprefix[(unsigned char)mode];
+}
+
+/* Apply a change of modes from MODE or RPL_CHANNELMODEIS: params are the
+ * modestring and its arguments. This keeps chan->mode ("+ntk key") and the
+ * privileges of nicks up to date without asking the server for them again.
+ * Returns 1 if any nick's privileges changed. */
+int
+chan_mode(struct Server *server, struct Channel *chan, char **params) {
+	char modes[64], *args[64];
+	char buf[512];
+	char *old = NULL, *save, *s, *arg, type, prefix;
+	struct Nick *nick;
+	size_t len = 0, i, blen;
+	int set = 1, ret = 0;
+
+	assert_warn(server && chan && params && *params, 0);
+
+	/* what is already known */
+	if (chan->mode) {
+		old = estrdup(chan->mode);
+		s = strtok_r(old, " ", &save);
+		for (; s && *s; s++) {
+			if (*s == '+' || len >= sizeof(modes))
+				continue;
+			type = chan_modetype(server, *s);
+			modes[len] = *s;
+			args[len++] = type == 'B' || type == 'C' ? strtok_r(NULL, " ", &save) : NULL;
+		}
+	}
+
+	for (s = *params++; *s; s++) {
+		if (*s == '+' || *s == '-') {
+			set = *s == '+';
+			continue;
+		}
+
+		type = chan_modetype(server, *s);
+		if (type == 'P' || type == 'A' || type == 'B' || (type == 'C' && set))
+			arg = *params ? *params++ : NULL;
+		else
+			arg = NULL;
+
+		if (type == 'P') {
+			if (arg && (prefix = chan_modeprefix(server, *s)) &&
+					(nick = nick_get(&chan->nicks, arg, server))) {
+				nick_setpriv(nick, server, prefix, set);
+				ret = 1;
+			}
+			continue;
+		} else if (type == 'A') {
+			continue;
+		}
+
+		for (i = 0; i < len && modes[i] != *s; i++);
+		if (set && i == len && len < sizeof(modes))
+			len++;
+		if (set && i < len) {
+			modes[i] = *s;
+			args[i] = arg;
+		} else if (!set && i < len) {
+			memmove(&modes[i], &modes[i + 1], len - i - 1);
+			memmove(&args[i], &args[i + 1], (len - i - 1) * sizeof(*args));
+			len--;
+		}
+	}
+
+	blen = snprintf(buf, sizeof(buf), "+%.*s", (int)len, modes);
+	for (i = 0; i < len && blen < sizeof(buf); i++)
+		if (args[i])
+			blen += snprintf(buf + blen, sizeof(buf) - blen, " %s", args[i]);
+
+	pfree(&chan->mode);
+	chan->mode = estrdup(buf);
+	pfree(&old);
+	return ret;
+}
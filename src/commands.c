@@ -112,11 +112,7 @@ command_msg) {
 	else
 		chan = chan_get(&server->queries, target, -1);
 
-	serv_write(server, Sched_connected, "PRIVMSG %s :%s\r\n", target, message);
-	if (chan) {
-		hist_format(chan->history, Activity_self,
-				HIST_SHOW|HIST_LOG|HIST_SELF, "PRIVMSG %s :%s", target, message);
-	}
+	serv_message(server, chan, "PRIVMSG", target, message, 0);
 }
 
 COMMAND(
@@ -136,11 +132,7 @@ command_notice) {
 	else
 		chan = chan_get(&server->queries, target, -1);
 
-	serv_write(server, Sched_connected, "NOTICE %s :%s\r\n", target, message);
-	if (chan) {
-		hist_format(chan->history, Activity_self,
-				HIST_SHOW|HIST_LOG|HIST_SELF, "NOTICE %s :%s", target, message);
-	}
+	serv_message(server, chan, "NOTICE", target, message, 0);
 }
 
 COMMAND(
@@ -148,9 +140,7 @@ command_me) {
 	if (!str)
 		str = "";
 
-	serv_write(server, Sched_connected, "PRIVMSG %s :%cACTION %s%c\r\n", channel->name, 1, str, 1);
-	hist_format(channel->history, Activity_self,
-			HIST_SHOW|HIST_LOG|HIST_SELF, "PRIVMSG %s :%cACTION %s%c", channel->name, 1, str, 1);
+	serv_message(server, channel, "PRIVMSG", channel->name, str, 1);
 }
 
 COMMAND(
@@ -218,20 +208,31 @@ command_quit) {
 
 COMMAND(
 command_join) {
-	char msg[512];
-
-	if (!str) {
+	char name[512];
+	char *chans, *keys, *chan, *key;
+	char *csave = NULL, *ksave = NULL;
+	int first = 1;
+
+	/* /join #a,#b key: the main loop sends it with serv_join_send(),
+	 * along with any other channels waiting to be joined */
+	if (!str || !(chans = strtok_r(str, " ", &csave))) {
 		command_toofew("join");
 		return;
 	}
+	keys = strtok_r(NULL, " ", &csave);
+	csave = NULL;
+	for (chan = strtok_r(chans, ",", &csave); chan; chan = strtok_r(NULL, ",", &csave)) {
+		key = keys ? strtok_r(ksave ? NULL : keys, ",", &ksave) : NULL;
+		if (serv_ischannel(server, chan))
+			snprintf(name, sizeof(name), "%s", chan);
+		else
+			snprintf(name, sizeof(name), "%c%s", '#', chan);
 
-	if (serv_ischannel(server, str))
-		snprintf(msg, sizeof(msg), "JOIN %s\r\n", str);
-	else
-		snprintf(msg, sizeof(msg), "JOIN %c%s\r\n", '#', str);
-
-	serv_write(server, Sched_connected, "%s", msg);
-	expect_set(server, Expect_join, str);
+		serv_join(server, name, key);
+		if (first)
+			expect_set(server, Expect_join, name);
+		first = 0;
+	}
 }
 
 COMMAND(
@@ -257,8 +258,7 @@ command_part) {
 
 	snprintf(msg, sizeof(msg), "PART %s :%s\r\n", chan, reason ? reason : config_gets("def.partmessage"));
 
-	serv_write(server, Sched_connected, "%s", msg);
-	expect_set(server, Expect_part, chan);
+	serv_request(server, Sched_connected, Expect_part, chan, "%s", msg);
 }
 
 COMMAND(
@@ -334,11 +334,11 @@ command_mode) {
 
 	if (modes) {
 		if (channel && chan == channel->name)
-			expect_set(server, Expect_nosuchnick, chan);
-		serv_write(server, Sched_connected, "MODE %s %s\r\n", chan, modes);
+			serv_request(server, Sched_connected, Expect_nosuchnick, chan, "MODE %s %s\r\n", chan, modes);
+		else
+			serv_write(server, Sched_connected, "MODE %s %s\r\n", chan, modes);
 	} else {
-		expect_set(server, Expect_channelmodeis, chan);
-		serv_write(server, Sched_connected, "MODE %s\r\n", chan);
+		serv_request(server, Sched_connected, Expect_channelmodeis, chan, "MODE %s\r\n", chan);
 	}
 }
 
@@ -354,8 +354,13 @@ command_nick) {
 		return;
 	}
 
-	serv_write(server, Sched_now, "NICK %s\r\n", str);
-	expect_set(server, Expect_nicknameinuse, str);
+	/* the server would cut it short, or refuse it */
+	if (server->isupport.nicklen > 0 && strlen(str) > (size_t)server->isupport.nicklen) {
+		ui_error("/nick: %s is longer than the %d characters allowed", str, server->isupport.nicklen);
+		return;
+	}
+
+	serv_request(server, Sched_now, Expect_nicknameinuse, str, "NICK %s\r\n", str);
 }
 
 COMMAND(
@@ -424,8 +429,7 @@ command_ping) {
 		return;
 	}
 
-	serv_write(server, Sched_now, "PING :%s\r\n", str);
-	expect_set(server, Expect_pong, str);
+	serv_request(server, Sched_now, Expect_pong, str, "PING :%s\r\n", str);
 }
 
 COMMAND(
@@ -438,6 +442,53 @@ command_quote) {
 	serv_write(server, Sched_connected, "%s\r\n", str);
 }
 
+COMMAND(
+command_queue) {
+	hist_format(selected.history, Activity_none, HIST_UI, "SELF_QUEUE %s %d %d %d %d %lu %lu",
+			server->name, server->output.queue[Prio_urgent].lines,
+			server->output.queue[Prio_normal].lines,
+			server->output.queue[Prio_bulk].lines,
+			server->output.lines, server->output.sent,
+			server->output.delayed);
+}
+
+COMMAND(
+command_lag) {
+	unsigned long n;
+
+	if ((n = server->lag.count) == 0) {
+		ui_error("no lag measured for %s yet", server->name);
+		return;
+	}
+	if (n > LAG_SAMPLES)
+		n = LAG_SAMPLES;
+
+	hist_format(selected.history, Activity_none, HIST_UI, "SELF_LAG %s %lld %lu %lld %lld %lld %lld %lld",
+			server->name, serv_lag_get(server), n,
+			serv_lag_percentile(server, 0), serv_lag_percentile(server, 50),
+			serv_lag_percentile(server, 90), serv_lag_percentile(server, 99),
+			serv_lag_percentile(server, 100));
+}
+
+COMMAND(
+command_tls) {
+#ifdef TLS
+	char *session = "none";
+
+	if (!server->tls) {
+		ui_error("%s is not using TLS", server->name);
+		return;
+	}
+	if (server->tls_ctx && !server->tls_handshake && server->status != ConnStatus_notconnected)
+		session = tls_conn_session_resumed(server->tls_ctx) ? "resumed" : "new";
+
+	hist_format(selected.history, Activity_none, HIST_UI, "SELF_TLS_SESSION %s %s %lu %lu",
+			server->name, session, server->tls_resumed, server->tls_full);
+#else
+	hist_format(selected.history, Activity_none, HIST_UI, "SELF_TLSNOTCOMPILED %s", server->name);
+#endif /* TLS */
+}
+
 COMMAND(
 command_connect) {
 	struct Server *tserver;
@@ -650,7 +701,7 @@ command_select) {
 
 		if (tchannel) {
 			for (chp = sp->channels; chp; chp = chp->next)
-				if (strcmp(chp->name, tchannel) == 0)
+				if (serv_casecmp(sp, chp->name, tchannel) == 0)
 					break;
 
 			if (!chp) {
@@ -833,8 +884,7 @@ command_names) {
 		return;
 	}
 
-	serv_write(server, Sched_connected, "NAMES %s\r\n", chan);
-	expect_set(server, Expect_names, chan);
+	serv_request(server, Sched_connected, Expect_names, chan, "NAMES %s\r\n", chan);
 }
 
 COMMAND(
@@ -861,6 +911,8 @@ command_topic) {
 		chan = strtok_r(str,  " ", &topic);
 	else
 		chan = topic = NULL;
+	if (topic && !*topic)
+		topic = NULL;
 
 	if (chan && !serv_ischannel(server, chan)) {
 		topic = chan;
@@ -884,8 +936,7 @@ command_topic) {
 	}
 
 	if (!topic) {
-		serv_write(server, Sched_connected, "TOPIC %s\r\n", chan);
-		expect_set(server, Expect_topic, chan);
+		serv_request(server, Sched_connected, Expect_topic, chan, "TOPIC %s\r\n", chan);
 	} else serv_write(server, Sched_connected, "TOPIC %s :%s\r\n", chan, topic);
 }
 
@@ -1716,7 +1767,7 @@ idrange:
 static void
 modelset(char *cmd, struct Server *server, struct Channel *channel,
 		int remove, char mode, char *args) {
-	char *percmds, *p;
+	char *p;
 	char *modes;
 	int percmd;
 	int i;
@@ -1727,11 +1778,7 @@ modelset(char *cmd, struct Server *server, struct Channel *channel,
 		return;
 	}
 
-	percmds = support_get(server, "MODES");
-	if (percmds)
-		percmd = atoi(percmds);
-	else
-		percmd = config_getl("def.modes");
+	percmd = server->isupport.modes;
 
 	/*
 	 * Now, I'd hope that servers do something clever like determining this
@@ -2005,7 +2052,6 @@ alias_eval(char *cmd) {
 void
 command_eval(struct Server *server, char *str) {
 	struct Command *cmdp;
-	char msg[512];
 	char *cmd;
 	char *s, *dup;
 
@@ -2018,10 +2064,7 @@ command_eval(struct Server *server, char *str) {
 			s += 2;
 
 		if (selected.channel && selected.server) {
-			// TODO: message splitting
-			snprintf(msg, sizeof(msg), "PRIVMSG %s :%s", selected.channel->name, s);
-			serv_write(selected.server, Sched_connected, "%s\r\n", msg);
-			hist_format(selected.channel->history, Activity_self, HIST_SHOW|HIST_LOG|HIST_SELF, "%s", msg);
+			serv_message(selected.server, selected.channel, "PRIVMSG", selected.channel->name, s, 0);
 		} else {
 			ui_error("channel not selected, message ignored", NULL);
 		}
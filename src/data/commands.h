@@ -37,6 +37,9 @@ COMMAND(command_who);
 COMMAND(command_whowas);
 COMMAND(command_ping);
 COMMAND(command_quote);
+COMMAND(command_queue);
+COMMAND(command_lag);
+COMMAND(command_tls);
 COMMAND(command_connect);
 COMMAND(command_disconnect);
 COMMAND(command_names);
@@ -111,9 +114,25 @@ struct Command commands[] = {
 	{"quote", command_quote, 1, {
 		"usage: /quote <message>",
 		"Send raw message to server", NULL}},
+	{"queue", command_queue, 1, {
+		"usage: /queue",
+		"Show lines waiting to be sent to the server.",
+		"Lines are held back by flood control, see",
+		"flood.burst and flood.interval.", NULL}},
+	{"lag", command_lag, 1, {
+		"usage: /lag",
+		"Show the lag to the server, measured with PINGs",
+		"every lag.interval seconds. Percentiles are of",
+		"recent PINGs, and accurate to within 12.5%.", NULL}},
+	{"tls", command_tls, 1, {
+		"usage: /tls",
+		"Show whether the TLS session with the server was",
+		"resumed, and how many handshakes resumed one or",
+		"were done in full since hirc started.", NULL}},
 	{"join", command_join, 1, {
-		"usage: /join <channel>",
-		"Join channel", NULL}},
+		"usage: /join <channel>[,channel...] [key[,key...]]",
+		"Join channels. Those joined at the same time,",
+		"such as by autocmds, are sent in as few lines as possible.", NULL}},
 	{"part", command_part, 1, {
 		"usage: /part <channel> [reason]",
 		"Part channel", NULL}},
@@ -75,6 +75,14 @@ struct Config config[] = {
 		"If a server doesn't supply this in the nonstandard",
 		"RPL_ISUPPORT, it likely won't support nonstandard",
 		"prefixes.", NULL}},
+	{"def.chanmodes", 1, Val_string,
+		.str = "beI,k,l,imnpst",
+		.strhandle = NULL,
+		.description = {
+		"You most likely don't want to touch this.",
+		"If a server doesn't supply CHANMODES in RPL_ISUPPORT,",
+		"assume it has these channel modes, grouped as:",
+		"lists,always take an argument,take one when set,never do", NULL}},
 	{"def.modes", 1, Val_signed,
 		.num = 1,
 		.numhandle = NULL,
@@ -82,6 +90,92 @@ struct Config config[] = {
 		"You most likely don't want to touch this.",
 		"If a server doesn't send MODES=... in RPL_ISUPPORT,",
 		"use this number instead.", NULL}},
+	{"connect.delay", 1, Val_nzunsigned,
+		.num = 250,
+		.numhandle = NULL,
+		.description = {
+		"Milliseconds to wait on a connection attempt before",
+		"also trying the server's next address. Attempts race",
+		"each other and the first to connect is used.", NULL}},
+#ifdef IOTHREAD
+	{"connect.thread", 1, Val_bool,
+		.num = 0,
+		.numhandle = NULL,
+		.description = {
+		"Read from and write to each server in a thread of its own.",
+		"Applies to connections made after it is set.", NULL}},
+#endif /* IOTHREAD */
+#ifdef TLS
+	{"tls.session", 1, Val_bool,
+		.num = 1,
+		.numhandle = NULL,
+		.description = {
+		"Resume TLS sessions when reconnecting to a server,",
+		"skipping most of the handshake if the server allows it.", NULL}},
+	{"tls.session.dir", 1, Val_string,
+		.str = NULL,
+		.strhandle = NULL,
+		.description = {
+		"Directory to keep TLS sessions in, one file per server,",
+		"so they can also be resumed after hirc is restarted.",
+		"Unset, sessions are only kept in memory.",
+		"Can contain ~ to refer to $HOME", NULL}},
+#endif /* TLS */
+	{"dns.ttl", 1, Val_unsigned,
+		.num = 300,
+		.numhandle = NULL,
+		.description = {
+		"Seconds to remember the addresses a host resolved to.",
+		"Set to 0 to look up a host every time it is connected to.", NULL}},
+	{"flood.burst", 1, Val_unsigned,
+		.num = 5,
+		.numhandle = NULL,
+		.description = {
+		"Number of lines that can be sent to a server at once",
+		"before flood control starts holding them back.",
+		"Set to 0 to disable flood control.", NULL}},
+	{"flood.interval", 1, Val_nzunsigned,
+		.num = 2000,
+		.numhandle = NULL,
+		.description = {
+		"Once flood.burst lines have been sent, send one",
+		"more every this many milliseconds.",
+		"PONG, QUIT and registration are always sent first,",
+		"then messages, then queries such as NAMES and WHO.", NULL}},
+	{"lag.interval", 1, Val_unsigned,
+		.num = 30,
+		.numhandle = NULL,
+		.description = {
+		"Seconds between PINGs sent to measure lag, 0 to disable.",
+		"The lag is shown in the buflist, see also /lag.", NULL}},
+	{"rejoin", 1, Val_bool,
+		.num = 1,
+		.numhandle = NULL,
+		.description = {
+		"Rejoin channels after reconnecting to a server.",
+		"They are joined along with those in autocmds,",
+		"as few JOIN lines as possible.", NULL}},
+	{"chathistory.page", 1, Val_nzunsigned,
+		.num = 50,
+		.numhandle = NULL,
+		.description = {
+		"Messages asked for at a time from servers with chathistory:",
+		"on joining, those missed since the last one in the buffer,",
+		"and older ones on scrolling to the top. Servers may allow less.", NULL}},
+	{"netsplit.wait", 1, Val_unsigned,
+		.num = 2,
+		.numhandle = NULL,
+		.description = {
+		"Seconds to hold QUITs that look like a netsplit (two",
+		"server names as the reason) so that they're dealt with",
+		"together. 0 to handle each as it comes. Servers that",
+		"send netsplits as a batch don't need this.", NULL}},
+	{"netsplit.rejoin", 1, Val_unsigned,
+		.num = 600,
+		.numhandle = NULL,
+		.description = {
+		"Seconds after such a netsplit that nicks in it joining",
+		"again are held the same way, as a netjoin.", NULL}},
 	{"reconnect.interval", 1, Val_nzunsigned,
 		.num = 10,
 		.numhandle = NULL,
@@ -267,6 +361,33 @@ struct Config config[] = {
 		.strhandle = config_formats,
 		.description = {
 		"Format of SELF_CONNECTFAIL messages", NULL}},
+	{"format.ui.queue", 1, Val_string,
+		.str = "Queue for ${1}: ${2} urgent, ${3} normal and ${4} bulk lines waiting, ${5} being written (${6} sent, ${7} held back)",
+		.strhandle = config_formats,
+		.description = {
+		"Format of SELF_QUEUE messages", NULL}},
+	{"format.ui.lag", 1, Val_string,
+		.str = "Lag to ${1}: ${2}ms now, ${4}ms min, ${5}ms median, ${6}ms 90%, ${7}ms 99%, ${8}ms max (last ${3} PINGs)",
+		.strhandle = config_formats,
+		.description = {
+		"Format of SELF_LAG messages", NULL}},
+	{"format.ui.chanlimit", 1, Val_string,
+		.str = "Not joining ${2}: CHANLIMIT for ${1} reached",
+		.strhandle = config_formats,
+		.description = {
+		"Format of SELF_CHANLIMIT messages", NULL}},
+	{"format.ui.netsplit", 1, Val_string,
+		.str = "%{b}%{c:40}<%{o}%{=}Netsplit %{b}${1}%{b} <-> %{b}${2}%{b}, ${3} quit: ${4}",
+		.strhandle = config_formats,
+		.description = {
+		"Format of a netsplit, in place of each QUIT.",
+		"Only used when the server sends netsplits as a batch.", NULL}},
+	{"format.ui.netjoin", 1, Val_string,
+		.str = "%{b}%{c:44}+%{o}%{=}Netjoin %{b}${1}%{b} <-> %{b}${2}%{b}, ${3} joined: ${4}",
+		.strhandle = config_formats,
+		.description = {
+		"Format of a netjoin, in place of each JOIN.",
+		"Only used when the server sends netjoins as a batch.", NULL}},
 #ifndef TLS
 	{"format.ui.tls.notcompiled", 1, Val_string,
 		.str = "TLS not compiled into hirc",
@@ -279,6 +400,11 @@ struct Config config[] = {
 		.strhandle = config_formats,
 		.description = {
 		"TLS version and crypto information.", NULL}},
+	{"format.ui.tls.session", 1, Val_string,
+		.str = "Session: %{b}${2}%{b} (${3} resumed, ${4} full handshakes)",
+		.strhandle = config_formats,
+		.description = {
+		"Whether the TLS session was resumed, with running counts.", NULL}},
 	{"format.ui.tls.sni", 1, Val_string,
 		.str = "SNI name: %{b}${2}%{b}",
 		.strhandle = config_formats,
@@ -430,6 +556,11 @@ struct Config config[] = {
 		.strhandle = config_formats,
 		.description = {
 		"Indicator for buffer with activity of level `hilight`", NULL}},
+	{"format.ui.buflist.lag", 1, Val_string,
+		.str = "%{c:92}",
+		.strhandle = config_formats,
+		.description = {
+		"Shown before a server's lag", NULL}},
 	{"format.ui.buflist.more", 1, Val_string,
 		.str = "%{c:92}...",
 		.strhandle = config_formats,
@@ -29,10 +29,16 @@ struct {
 	{"SELF_CONNECTED",	"format.ui.connected"},
 	{"SELF_LOOKUPFAIL",	"format.ui.lookupfail"},
 	{"SELF_CONNECTFAIL",	"format.ui.connectfail"},
+	{"SELF_QUEUE",		"format.ui.queue"},
+	{"SELF_CHANLIMIT",	"format.ui.chanlimit"},
+	{"SELF_LAG",		"format.ui.lag"},
+	{"SELF_NETSPLIT",	"format.ui.netsplit"},
+	{"SELF_NETJOIN",	"format.ui.netjoin"},
 #ifndef TLS
 	{"SELF_TLSNOTCOMPILED",	"format.ui.tls.notcompiled"},
 #else
 	{"SELF_TLS_VERSION",	"format.ui.tls.version"},
+	{"SELF_TLS_SESSION",	"format.ui.tls.session"},
 	{"SELF_TLS_SNI",	"format.ui.tls.sni"},
 	{"SELF_TLS_ISSUER",	"format.ui.tls.issuer"},
 	{"SELF_TLS_SUBJECT",	"format.ui.tls.subject"},
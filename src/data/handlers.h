@@ -19,12 +19,15 @@
 
 #define HANDLER(func) static void func(struct Server *server, struct History *msg)
 HANDLER(handle_ERROR);
+HANDLER(handle_CAP);
 HANDLER(handle_PING);
 HANDLER(handle_PONG);
 HANDLER(handle_JOIN);
 HANDLER(handle_PART);
 HANDLER(handle_KICK);
 HANDLER(handle_QUIT);
+HANDLER(handle_BATCH);
+HANDLER(handle_FAIL);
 HANDLER(handle_NICK);
 HANDLER(handle_MODE);
 HANDLER(handle_TOPIC);
@@ -43,17 +46,22 @@ HANDLER(handle_RPL_MOTD);
 HANDLER(handle_RPL_ENDOFMOTD);
 HANDLER(handle_ERR_NOSUCHNICK);
 HANDLER(handle_ERR_NICKNAMEINUSE);
+HANDLER(handle_ERR_CANTJOIN);
 HANDLER(handle_RPL_AWAY);
 
 struct Ignore *ignores = NULL;
 struct Handler handlers[] = {
 	{ "ERROR",	handle_ERROR			},
+	{ "CAP",	handle_CAP			},
 	{ "PING", 	handle_PING			},
 	{ "PONG",	handle_PONG			},
 	{ "JOIN",	handle_JOIN			},
 	{ "PART",	handle_PART			},
 	{ "KICK",	handle_KICK			},
 	{ "QUIT",	handle_QUIT			},
+	{ "BATCH",	handle_BATCH			},
+	{ "ACK",	NULL				}, /* labeled reply with nothing in it */
+	{ "FAIL",	handle_FAIL			},
 	{ "NICK",	handle_NICK			},
 	{ "MODE",	handle_MODE			},
 	{ "TOPIC",	handle_TOPIC			},
@@ -78,6 +86,14 @@ struct Handler handlers[] = {
 	{ "375",	handle_RPL_MOTD			}, /* RPL_MOTDSTART, but handle it the same way as RPL_MOTD */
 	{ "376",	handle_RPL_ENDOFMOTD		},
 	{ "401",	handle_ERR_NOSUCHNICK		},
+	{ "403",	handle_ERR_CANTJOIN		}, /* ERR_NOSUCHCHANNEL */
+	{ "405",	handle_ERR_CANTJOIN		}, /* ERR_TOOMANYCHANNELS */
 	{ "433",	handle_ERR_NICKNAMEINUSE	},
+	{ "470",	handle_ERR_CANTJOIN		}, /* ERR_LINKCHANNEL: forwarded */
+	{ "471",	handle_ERR_CANTJOIN		}, /* ERR_CHANNELISFULL */
+	{ "473",	handle_ERR_CANTJOIN		}, /* ERR_INVITEONLYCHAN */
+	{ "474",	handle_ERR_CANTJOIN		}, /* ERR_BANNEDFROMCHAN */
+	{ "475",	handle_ERR_CANTJOIN		}, /* ERR_BADCHANNELKEY */
+	{ "477",	handle_ERR_CANTJOIN		}, /* ERR_NEEDREGGEDNICK */
 	{ NULL,		NULL 				},
 };
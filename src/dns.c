@@ -0,0 +1,232 @@
+/*
+ * src/dns.c from hirc
+ *
+ * Copyright (c) 2021-2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "hirc.h"
+
+/*
+ * Name resolution.
+ *
+ * getaddrinfo() blocks, so each lookup is run in its own short-lived
+ * thread. The thread only touches its own struct Lookup, and hands it back
+ * by writing the pointer down a pipe that the event loop watches. Everything
+ * else happens in the main thread, in dns_read().
+ *
+ * Results are cached for dns.ttl seconds. getaddrinfo() does not tell us
+ * the real TTL of a record, hence the fixed value. While a lookup is in
+ * progress, other servers asking for the same host and port wait for it
+ * instead of starting their own.
+ */
+
+static struct Lookup *lookups = NULL;
+static struct DNSCache *cache = NULL;
+static int pipefd[2] = {-1, -1};
+
+static void
+dns_free(struct DNSCache *dc) {
+	if (dc->prev)
+		dc->prev->next = dc->next;
+	else
+		cache = dc->next;
+	if (dc->next)
+		dc->next->prev = dc->prev;
+	pfree(&dc->host);
+	pfree(&dc->port);
+	freeaddrinfo(dc->ai);
+	pfree(&dc);
+}
+
+static struct DNSCache *
+dns_cache_get(char *host, char *port) {
+	struct DNSCache *p, *next;
+	time_t now = time(NULL);
+
+	for (p = cache; p; p = next) {
+		next = p->next;
+		if (p->expires <= now) {
+			if (!p->refs)
+				dns_free(p);
+		} else if (strcmp(p->host, host) == 0 && strcmp(p->port, port) == 0) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static void *
+dns_thread(void *data) {
+	struct Lookup *lookup = data;
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	lookup->ai = NULL;
+	lookup->ret = getaddrinfo(lookup->host, lookup->port, &hints, &lookup->ai);
+	if (lookup->ret == 0 && lookup->ai == NULL)
+		lookup->ret = EAI_NONAME;
+	while (write(pipefd[1], &lookup, sizeof(lookup)) == -1 && errno == EINTR);
+	return NULL;
+}
+
+void
+dns_init(void) {
+	if (pipe(pipefd) == -1)
+		die(1, "pipe(): %s\n", strerror(errno));
+	fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+	if (event_watch(pipefd[0], EVENT_DNS) == -1)
+		die(1, "cannot watch resolver pipe: %s\n", strerror(errno));
+}
+
+/* Resolve server->host and server->port, calling serv_resolved() with the
+ * result. This happens immediately if the result is cached. */
+void
+dns_lookup(struct Server *server) {
+	struct DNSCache *dc;
+	struct Lookup *lookup, *p;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	assert_warn(server,);
+
+	if ((dc = dns_cache_get(server->host, server->port))) {
+		dc->refs++;
+		serv_resolved(server, dc, 0);
+		return;
+	}
+
+	lookup = emalloc(sizeof(struct Lookup));
+	lookup->host = estrdup(server->host);
+	lookup->port = estrdup(server->port);
+	lookup->server = server;
+	lookup->ai = NULL;
+	lookup->ret = 0;
+
+	for (p = lookups; p; p = p->next)
+		if (p->running && strcmp(p->host, lookup->host) == 0 &&
+				strcmp(p->port, lookup->port) == 0)
+			break;
+	lookup->running = p == NULL;
+
+	lookup->prev = NULL;
+	lookup->next = lookups;
+	if (lookups)
+		lookups->prev = lookup;
+	lookups = lookup;
+
+	if (!lookup->running)
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, dns_thread, lookup) != 0)
+		dns_thread(lookup); /* block rather than fail */
+	pthread_attr_destroy(&attr);
+}
+
+/* Forget about any lookup for server, eg. on disconnect */
+void
+dns_cancel(struct Server *server) {
+	struct Lookup *p;
+
+	for (p = lookups; p; p = p->next)
+		if (p->server == server)
+			p->server = NULL;
+}
+
+/* Drop a reference taken by dns_lookup() */
+void
+dns_release(struct DNSCache *dc) {
+	if (!dc)
+		return;
+	if (--dc->refs == 0 && dc->expires <= time(NULL))
+		dns_free(dc);
+}
+
+/* Don't use dc for any new lookups, eg. when none of its addresses work */
+void
+dns_expire(struct DNSCache *dc) {
+	if (dc)
+		dc->expires = 0;
+}
+
+/* Read finished lookups from the pipe, called from the main loop */
+void
+dns_read(void) {
+	struct Lookup *done, *p, *next;
+	struct DNSCache *dc;
+
+	while (read(pipefd[0], &done, sizeof(done)) == sizeof(done)) {
+		dc = NULL;
+		if (done->ret == 0) {
+			dc = emalloc(sizeof(struct DNSCache));
+			dc->host = estrdup(done->host);
+			dc->port = estrdup(done->port);
+			dc->ai = done->ai;
+			dc->expires = time(NULL) + config_getl("dns.ttl");
+			dc->refs = 1; /* held until every waiter has been served */
+			dc->prev = NULL;
+			dc->next = cache;
+			if (cache)
+				cache->prev = dc;
+			cache = dc;
+		}
+
+		for (p = lookups; p; p = next) {
+			next = p->next;
+			if (p != done && (p->running || strcmp(p->host, done->host) != 0 ||
+					strcmp(p->port, done->port) != 0))
+				continue;
+
+			if (p->prev)
+				p->prev->next = p->next;
+			else
+				lookups = p->next;
+			if (p->next)
+				p->next->prev = p->prev;
+
+			if (p->server) {
+				if (dc)
+					dc->refs++;
+				serv_resolved(p->server, dc, done->ret);
+			}
+			if (p != done) {
+				pfree(&p->host);
+				pfree(&p->port);
+				pfree(&p);
+			}
+		}
+
+		dns_release(dc);
+		pfree(&done->host);
+		pfree(&done->port);
+		pfree(&done);
+	}
+}
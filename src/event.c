@@ -0,0 +1,294 @@
+/*
+ * src/event.c from hirc
+ *
+ * Copyright (c) 2021-2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#ifdef EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif /* EPOLL */
+#include "hirc.h"
+
+/*
+ * The event loop.
+ *
+ * Every file descriptor hirc waits on is registered here: stdin (read by
+ * ncurses), a socket for each server and, with epoll, a signalfd for
+ * SIGWINCH and a timerfd for timeouts. event_wait() sleeps until one of
+ * these is ready, marks servers through server->revents and returns flags
+ * for anything else. Nothing wakes hirc up unless there is something to do:
+ * code that needs to be woken up later asks for it with event_timer().
+ *
+ * Without epoll (-DEPOLL is set by configure), poll() is used instead.
+ * SIGWINCH is then left to ncurses, which will interrupt poll() and later
+ * return KEY_RESIZE from ui_read().
+ */
+
+#define EVENT_BATCH 64 /* max events returned by one epoll_wait() */
+
+static struct Event *events = NULL;
+static long waitms = -1;
+#ifdef EPOLL
+static int epfd = -1;
+static int sigfd = -1;
+static int timerfd = -1;
+#else
+static struct pollfd *pollfds = NULL;
+static size_t pollsize = 0;
+#endif /* EPOLL */
+
+static struct Event *
+event_get(int fd) {
+	struct Event *p;
+
+	for (p = events; p; p = p->next)
+		if (p->fd == fd)
+			return p;
+	return NULL;
+}
+
+static int
+event_new(int fd, enum EventOpt want, enum EventOpt flag, struct Server *server) {
+	struct Event *ev;
+#ifdef EPOLL
+	struct epoll_event epev;
+#endif /* EPOLL */
+
+	assert_warn(fd >= 0, -1);
+
+	ev = emalloc(sizeof(struct Event));
+	ev->fd = fd;
+	ev->want = want;
+	ev->flag = flag;
+	ev->server = server;
+
+#ifdef EPOLL
+	memset(&epev, 0, sizeof(epev));
+	epev.events = (want & EVENT_READ ? EPOLLIN : 0) | (want & EVENT_WRITE ? EPOLLOUT : 0);
+	epev.data.ptr = ev;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev) == -1) {
+		pfree(&ev);
+		return -1;
+	}
+#endif /* EPOLL */
+
+	ev->prev = NULL;
+	ev->next = events;
+	if (events)
+		events->prev = ev;
+	events = ev;
+	return 0;
+}
+
+void
+event_init(void) {
+#ifdef EPOLL
+	sigset_t set;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		die(1, "epoll_create1(): %s\n", strerror(errno));
+
+	/* SIGWINCH must be blocked for it to be read from a signalfd,
+	 * this also stops ncurses' handler from being called. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGWINCH);
+	if (sigprocmask(SIG_BLOCK, &set, NULL) == -1 ||
+			(sigfd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+		die(1, "signalfd(): %s\n", strerror(errno));
+
+	if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+		die(1, "timerfd_create(): %s\n", strerror(errno));
+
+	if (event_new(sigfd, EVENT_READ, EVENT_RESIZE, NULL) == -1 ||
+			event_new(timerfd, EVENT_READ, EVENT_TIMER, NULL) == -1)
+		die(1, "epoll_ctl(): %s\n", strerror(errno));
+#endif /* EPOLL */
+
+	if (event_new(STDIN_FILENO, EVENT_READ, EVENT_INPUT, NULL) == -1)
+		die(1, "cannot watch stdin: %s\n", strerror(errno));
+}
+
+int
+event_add(int fd, enum EventOpt want, struct Server *server) {
+	assert_warn(server, -1);
+
+	if (event_get(fd))
+		return event_mod(fd, want);
+	if (event_new(fd, want, 0, server) == -1) {
+		ui_perror("event_add()");
+		return -1;
+	}
+	return 0;
+}
+
+/* Watch fd for reading, event_wait() returns flag when it is readable */
+int
+event_watch(int fd, enum EventOpt flag) {
+	assert_warn(!event_get(fd), -1);
+	return event_new(fd, EVENT_READ, flag, NULL);
+}
+
+int
+event_mod(int fd, enum EventOpt want) {
+	struct Event *ev;
+#ifdef EPOLL
+	struct epoll_event epev;
+#endif /* EPOLL */
+
+	if ((ev = event_get(fd)) == NULL)
+		return -1;
+	if (ev->want == want)
+		return 0;
+
+#ifdef EPOLL
+	memset(&epev, 0, sizeof(epev));
+	epev.events = (want & EVENT_READ ? EPOLLIN : 0) | (want & EVENT_WRITE ? EPOLLOUT : 0);
+	epev.data.ptr = ev;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &epev) == -1) {
+		ui_perror("epoll_ctl()");
+		return -1;
+	}
+#endif /* EPOLL */
+
+	ev->want = want;
+	return 0;
+}
+
+void
+event_del(int fd) {
+	struct Event *ev;
+
+	if ((ev = event_get(fd)) == NULL)
+		return;
+
+#ifdef EPOLL
+	/* Must happen before the fd is closed */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif /* EPOLL */
+
+	if (ev->prev)
+		ev->prev->next = ev->next;
+	else
+		events = ev->next;
+	if (ev->next)
+		ev->next->prev = ev->prev;
+	pfree(&ev);
+}
+
+/* Milliseconds on a monotonic clock, for measuring intervals. */
+long long
+event_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Ask to be woken up in at most ms milliseconds.
+ * This lasts for the next call of event_wait() only. */
+void
+event_timer(long ms) {
+	if (ms < 0)
+		ms = 0;
+	if (waitms < 0 || ms < waitms)
+		waitms = ms;
+}
+
+int
+event_wait(void) {
+	struct Event *ev;
+	int ret = 0, n, i;
+#ifdef EPOLL
+	struct epoll_event epevs[EVENT_BATCH];
+	struct signalfd_siginfo si;
+	struct itimerspec its;
+	uint64_t expirations;
+
+	memset(&its, 0, sizeof(its));
+	if (waitms >= 0) {
+		/* a zeroed it_value would disarm the timer */
+		its.it_value.tv_sec = waitms / 1000;
+		its.it_value.tv_nsec = (waitms % 1000) * 1000000 + 1;
+	}
+	timerfd_settime(timerfd, 0, &its, NULL);
+	waitms = -1;
+
+	if ((n = epoll_wait(epfd, epevs, EVENT_BATCH, -1)) == -1)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		ev = epevs[i].data.ptr;
+		if (ev->server) {
+			if (epevs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+				ev->server->revents |= EVENT_READ;
+			if (epevs[i].events & (EPOLLOUT|EPOLLERR))
+				ev->server->revents |= EVENT_WRITE;
+			continue;
+		}
+
+		if (ev->flag == EVENT_RESIZE)
+			while (read(sigfd, &si, sizeof(si)) > 0);
+		else if (ev->flag == EVENT_TIMER)
+			read(timerfd, &expirations, sizeof(expirations));
+		ret |= ev->flag;
+	}
+#else
+	for (n = 0, ev = events; ev; ev = ev->next)
+		n++;
+	if (n > pollsize) {
+		pollsize = n;
+		pollfds = pollfds ? erealloc(pollfds, sizeof(struct pollfd) * pollsize)
+				: emalloc(sizeof(struct pollfd) * pollsize);
+	}
+
+	for (i = 0, ev = events; ev; ev = ev->next, i++) {
+		pollfds[i].fd = ev->fd;
+		pollfds[i].events = (ev->want & EVENT_READ ? POLLIN : 0) | (ev->want & EVENT_WRITE ? POLLOUT : 0);
+		pollfds[i].revents = 0;
+	}
+
+	n = poll(pollfds, i, waitms);
+	if (n == 0 && waitms >= 0)
+		ret |= EVENT_TIMER;
+	waitms = -1;
+	if (n == -1) /* SIGWINCH: let ncurses deliver KEY_RESIZE */
+		return errno == EINTR ? EVENT_INPUT : -1;
+
+	for (i = 0, ev = events; ev; ev = ev->next, i++) {
+		if (!pollfds[i].revents)
+			continue;
+		if (ev->server) {
+			if (pollfds[i].revents & (POLLIN|POLLHUP|POLLERR))
+				ev->server->revents |= EVENT_READ;
+			if (pollfds[i].revents & (POLLOUT|POLLERR))
+				ev->server->revents |= EVENT_WRITE;
+		} else {
+			ret |= ev->flag;
+		}
+	}
+#endif /* EPOLL */
+
+	return ret;
+}
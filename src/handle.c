@@ -24,6 +24,11 @@
 #include "hirc.h"
 #include "data/handlers.h"
 
+static void handle_msg(struct Server *server, char *msg, char *tags, time_t timestamp);
+static int handle_splitquit(struct Server *server, struct History *msg);
+static int handle_rejoin(struct Server *server, struct History *msg);
+static void handle_chathistory(struct Server *server, struct Batch *batch);
+
 HANDLER(
 handle_PING) {
 	assert_warn(param_len(msg->params) >= 2,);
@@ -31,6 +36,95 @@ handle_PING) {
 	serv_write(server, Sched_now, "PONG :%s\r\n", *(msg->params+1));
 }
 
+/* Capabilities asked for when the server has them */
+static struct {
+	char *name;
+	enum Cap cap;
+} caps[] = {
+	{"multi-prefix",	Cap_multiprefix},
+	{"userhost-in-names",	Cap_userhostinnames},
+	{"message-tags",	Cap_messagetags},
+	{"server-time",		Cap_servertime},
+	{"batch",		Cap_batch},
+	{"labeled-response",	Cap_labeledresponse},
+	{"draft/chathistory",	Cap_chathistory},
+};
+
+static enum Cap
+cap_get(char *name) {
+	size_t i;
+
+	for (i = 0; i < sizeof(caps) / sizeof(*caps); i++)
+		if (strcmp(caps[i].name, name) == 0)
+			return caps[i].cap;
+	return 0;
+}
+
+/* Ask for what's in server->capreq, or finish negotiating */
+static void
+cap_req(struct Server *server) {
+	char req[512];
+	size_t len = 0, i;
+
+	for (i = 0; i < sizeof(caps) / sizeof(*caps); i++)
+		if (server->capreq & caps[i].cap)
+			len += snprintf(req + len, sizeof(req) - len, "%s%s",
+					len ? " " : "", caps[i].name);
+
+	if (len) {
+		serv_write(server, Sched_now, "CAP REQ :%s\r\n", req);
+	} else if (server->capneg) {
+		serv_write(server, Sched_now, "CAP END\r\n");
+		server->capneg = 0;
+	}
+}
+
+HANDLER(
+handle_CAP) {
+	char **params = msg->params;
+	char *sub, *list, *save, *name;
+	enum Cap cap;
+	int more;
+
+	assert_warn(param_len(params) >= 4,);
+
+	hist_addp(server->history, msg, Activity_status, HIST_LOG);
+
+	/* CAP <nick> <subcommand> [*] :<caps>, the * means more to come */
+	sub = *(params+2);
+	more = param_len(params) >= 5 && strcmp(*(params+3), "*") == 0;
+	list = estrdup(*(params + param_len(params) - 1));
+
+	for (name = strtok_r(list, " ", &save); name; name = strtok_r(NULL, " ", &save)) {
+		name[strcspn(name, "=")] = '\0'; /* LS 302 gives values */
+		if ((cap = cap_get(*name == '-' ? name + 1 : name)) == 0)
+			continue;
+
+		if (strcmp(sub, "LS") == 0 || strcmp(sub, "NEW") == 0) {
+			if (!(server->caps & cap))
+				server->capreq |= cap;
+		} else if (strcmp(sub, "ACK") == 0) {
+			if (*name == '-')
+				server->caps &= ~cap;
+			else
+				server->caps |= cap;
+			server->capreq &= ~cap;
+		} else if (strcmp(sub, "NAK") == 0) {
+			server->capreq &= ~cap;
+		} else if (strcmp(sub, "DEL") == 0) {
+			server->caps &= ~cap;
+		}
+	}
+	pfree(&list);
+
+	if (more)
+		return;
+	if (strcmp(sub, "LS") == 0 || strcmp(sub, "NEW") == 0)
+		cap_req(server);
+	else if ((strcmp(sub, "ACK") == 0 || strcmp(sub, "NAK") == 0) && !server->capreq)
+		cap_req(server);
+}
+
 HANDLER(
 handle_PONG) {
 	int len;
@@ -40,7 +134,9 @@ handle_PONG) {
 	/* RFC1459 says that PONG should have a list of daemons,
 	 * but that's not how PONG seems to work in modern IRC. 
 	 * Therefore, consider the last parameter as the "message" */
-	if (strcmp_n(*(msg->params + len - 1), expect_get(server, Expect_pong)) == 0) {
+	if (serv_lag_pong(server, *(msg->params + len - 1)))
+		return;
+	if (strcmp_n(*(msg->params + len - 1), expect_msg(server, msg, Expect_pong)) == 0) {
 		hist_addp(server->history, msg, Activity_status, HIST_DFL);
 		expect_set(server, Expect_pong, NULL);
 	}
@@ -50,24 +146,33 @@ HANDLER(
 handle_JOIN) {
 	struct Channel *chan;
 	struct Nick *nick;
+	struct History *last;
 	char *target;
 
 	assert_warn(msg->from && param_len(msg->params) >= 2,);
 
+	if (handle_rejoin(server, msg))
+		return;
+
 	target = *(msg->params+1);
 	if ((chan = chan_get(&server->channels, target, -1)) == NULL)
 		chan = chan_add(server, &server->channels, target, 0);
 	chan_setold(chan, 0);
 
 	nick = msg->from;
-	if (nick_get(&chan->nicks, nick->nick) == NULL)
+	if (nick_get(&chan->nicks, nick->nick, server) == NULL)
 		nick_add(&chan->nicks, msg->from->prefix, ' ', server);
 
+	/* what was missed since then is asked for below */
+	last = nick_isself(nick) ? hist_edge(chan->history, 0) : NULL;
+
 	hist_addp(server->history, msg, Activity_status, HIST_LOG);
 	hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 
 	if (nick_isself(nick)) {
-		if (strcmp_n(target, expect_get(server, Expect_join)) == 0)
+		serv_join_done(server, chan);
+		serv_chathistory(server, chan, Fetch_after, last);
+		if (serv_casecmp(server, target, expect_msg(server, msg, Expect_join)) == 0)
 			ui_select(server, chan);
 		else
 			windows[Win_buflist].refresh = 1;
@@ -93,13 +198,13 @@ handle_PART) {
 	if (nick_isself(nick)) {
 		chan_setold(chan, 1);
 		nick_free_list(&chan->nicks);
-		if (chan == selected.channel && strcmp_n(target, expect_get(server, Expect_part)) == 0) {
+		if (chan == selected.channel && serv_casecmp(server, target, expect_msg(server, msg, Expect_part)) == 0) {
 			ui_select(selected.server, NULL);
 			expect_set(server, Expect_part, NULL);
 		}
 		windows[Win_buflist].refresh = 1;
 	} else {
-		nick_remove(&chan->nicks, nick->nick);
+		nick_remove(&chan->nicks, nick->nick, server);
 		if (chan == selected.channel)
 			windows[Win_nicklist].refresh = 1;
 	}
@@ -128,7 +233,7 @@ handle_KICK) {
 			ui_select(selected.server, NULL);
 		windows[Win_buflist].refresh = 1;
 	} else {
-		nick_remove(&chan->nicks, nick->nick);
+		nick_remove(&chan->nicks, nick->nick, server);
 		if (chan == selected.channel)
 			windows[Win_nicklist].refresh = 1;
 	}
@@ -173,12 +278,14 @@ handle_QUIT) {
 	nick = msg->from;
 	if (nick_isself(nick)) {
 		serv_disconnect(server, 0, NULL);
+	} else if (handle_splitquit(server, msg)) {
+		return;
 	}
 
 	hist_addp(server->history, msg, Activity_status, HIST_LOG);
 	for (chan = server->channels; chan; chan = chan->next) {
-		if (nick_get(&chan->nicks, nick->nick) != NULL) {
-			nick_remove(&chan->nicks, nick->nick);
+		if (nick_get(&chan->nicks, nick->nick, server) != NULL) {
+			nick_remove(&chan->nicks, nick->nick, server);
 			hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 			if (chan == selected.channel)
 				windows[Win_nicklist].refresh = 1;
@@ -186,6 +293,428 @@ handle_QUIT) {
 	}
 }
 
+/* CASEMAPPING of the server whose nicks are being sorted or searched
+ * for, which qsort() and bsearch() have no way to pass on */
+static enum Casemap handle_casemap;
+
+static int
+handle_nickcmp(const void *a, const void *b) {
+	return strcmp_fold(handle_casemap, *(char **)a, *(char **)b);
+}
+
+/* Add nick to a space separated list, ending it with
+ * "..." once it's full: the count is given separately */
+static void
+handle_netnick(char *buf, size_t size, char *nick) {
+	size_t len;
+
+	len = strlen(buf);
+	if (len >= 3 && strcmp(buf + len - 3, "...") == 0)
+		return;
+	if (len + strlen(nick) + CONSTLEN(" ...") < size)
+		snprintf(buf + len, size - len, "%s%s", len ? " " : "", nick);
+	else
+		snprintf(buf + len, size - len, "%s...", len ? " " : "");
+}
+
+/* Sort nicks and list each once in buf, returning how many there are */
+static size_t
+handle_netnicks(char **nicks, size_t n, char *buf, size_t size) {
+	size_t i, count;
+
+	qsort(nicks, n, sizeof(char *), handle_nickcmp);
+	*buf = '\0';
+	for (i = count = 0; i < n; i++) {
+		if (i && handle_nickcmp(&nicks[i], &nicks[i - 1]) == 0)
+			continue;
+		handle_netnick(buf, size, nicks[i]);
+		count++;
+	}
+	return count;
+}
+
+/* The one line a netsplit or netjoin leaves in a buffer */
+static void
+handle_netline(struct HistInfo *histinfo, struct Batch *batch,
+		size_t count, char *nicks, enum HistOpt options) {
+	char line[1024];
+	int len;
+
+	len = param_len(batch->params);
+	snprintf(line, sizeof(line), "SELF_%s %s %s %zu :%s",
+			strcmp(batch->type, "netsplit") == 0 ? "NETSPLIT" : "NETJOIN",
+			len > 0 ? batch->params[0] : "*",
+			len > 1 ? batch->params[1] : "*",
+			count, nicks);
+	hist_add(histinfo, line, Activity_status, batch->timestamp, options);
+}
+
+/* Everyone in a netsplit batch is removed from each channel in a
+ * single pass over its nicks, rather than a handle_QUIT() each */
+static void
+handle_netsplit(struct Server *server, struct Batch *batch) {
+	struct History *p;
+	struct Channel *chan;
+	struct Nick *np, *next;
+	char **quits, nicks[512];
+	size_t n, count;
+
+	handle_casemap = server->isupport.casemap;
+	for (n = 0, p = batch->msgs; p; p = p->next)
+		n++;
+	quits = emalloc((n ? n : 1) * sizeof(char *));
+
+	for (n = 0, p = batch->msgs; p; p = p->next) {
+		if (strcmp_n(*p->params, "QUIT") == 0 && p->from && p->from->nick && !p->from->self)
+			quits[n++] = p->from->nick;
+		else
+			handle_msg(server, p->raw, p->tags, p->timestamp);
+	}
+
+	if ((count = handle_netnicks(quits, n, nicks, sizeof(nicks))))
+		handle_netline(server->history, batch, count, nicks, HIST_LOG);
+
+	for (chan = server->channels; n && chan; chan = chan->next) {
+		*nicks = '\0';
+		for (count = 0, np = chan->nicks; np; np = next) {
+			next = np->next;
+			if (bsearch(&np->nick, quits, n, sizeof(char *), handle_nickcmp)) {
+				handle_netnick(nicks, sizeof(nicks), np->nick);
+				nick_removep(&chan->nicks, np);
+				count++;
+			}
+		}
+		if (count) {
+			handle_netline(chan->history, batch, count, nicks, HIST_DFL);
+			if (chan == selected.channel)
+				windows[Win_nicklist].refresh = 1;
+		}
+	}
+
+	free(quits);
+}
+
+struct NetJoin {
+	struct Channel *chan;
+	char *nick;
+	char *prefix;
+};
+
+static int
+handle_netjoincmp(const void *a, const void *b) {
+	const struct NetJoin *x = a, *y = b;
+
+	if (x->chan != y->chan)
+		return x->chan < y->chan ? -1 : 1;
+	return strcmp_fold(handle_casemap, x->nick, y->nick);
+}
+
+/* Joins in a netjoin batch are grouped by channel, and each channel's
+ * nicks are checked against its group once, rather than a nick_get()
+ * per JOIN. If added, the nicks were put in as their JOINs were held,
+ * and only the lines are left to do. */
+static void
+handle_netjoin(struct Server *server, struct Batch *batch, int added) {
+	struct History *p;
+	struct Channel *chan;
+	struct NetJoin *joins, key, *found;
+	struct Nick *np;
+	char **names, *prev, nicks[512];
+	size_t n, i, j, count;
+
+	handle_casemap = server->isupport.casemap;
+	for (n = 0, p = batch->msgs; p; p = p->next)
+		n++;
+	joins = emalloc((n ? n : 1) * sizeof(struct NetJoin));
+	names = emalloc((n ? n : 1) * sizeof(char *));
+
+	for (n = 0, p = batch->msgs; p; p = p->next) {
+		if (strcmp_n(*p->params, "JOIN") == 0 && p->from && p->from->nick && !p->from->self &&
+				param_len(p->params) >= 2 &&
+				(chan = chan_get(&server->channels, *(p->params+1), -1)) != NULL) {
+			joins[n].chan = chan;
+			joins[n].nick = p->from->nick;
+			joins[n].prefix = p->from->prefix;
+			names[n++] = p->from->nick;
+		} else {
+			handle_msg(server, p->raw, p->tags, p->timestamp);
+		}
+	}
+
+	if ((count = handle_netnicks(names, n, nicks, sizeof(nicks))))
+		handle_netline(server->history, batch, count, nicks, HIST_LOG);
+
+	qsort(joins, n, sizeof(struct NetJoin), handle_netjoincmp);
+	for (i = 0; i < n; i = j) {
+		chan = joins[i].chan;
+		for (j = i; j < n && joins[j].chan == chan; j++);
+
+		/* anyone already here is left alone */
+		key.chan = chan;
+		for (np = added ? NULL : chan->nicks; np; np = np->next) {
+			key.nick = np->nick;
+			if ((found = bsearch(&key, joins + i, j - i, sizeof(struct NetJoin), handle_netjoincmp)))
+				found->prefix = NULL;
+		}
+
+		*nicks = '\0';
+		for (count = 0, prev = NULL; i < j; prev = joins[i++].nick) {
+			if (!joins[i].prefix || (prev && strcmp_fold(handle_casemap, joins[i].nick, prev) == 0))
+				continue;
+			if (!added)
+				nick_add(&chan->nicks, joins[i].prefix, ' ', server);
+			handle_netnick(nicks, sizeof(nicks), joins[i].nick);
+			count++;
+		}
+		if (count) {
+			handle_netline(chan->history, batch, count, nicks, HIST_DFL);
+			if (chan == selected.channel)
+				windows[Win_nicklist].refresh = 1;
+		}
+	}
+
+	free(joins);
+	free(names);
+}
+
+/* Merge a page of history from serv_chathistory() into the buffer,
+ * leaving out what's already there, and ask for the next if needed */
+static void
+handle_chathistory(struct Server *server, struct Batch *batch) {
+	struct Channel *chan;
+	struct History *p;
+	enum Fetch fetch;
+	int added = 0;
+
+	if (!batch->params || !*batch->params ||
+			(!(chan = chan_get(&server->channels, *batch->params, -1)) &&
+			 !(chan = chan_get(&server->queries, *batch->params, -1))))
+		return;
+
+	fetch = chan->fetch;
+	chan->fetch = Fetch_none;
+
+	for (p = batch->msgs; p; p = p->next) {
+		if (hist_find(chan->history, p))
+			continue;
+		if (hist_addp(chan->history, p, Activity_status, HIST_DFL))
+			added++;
+	}
+
+	if (fetch == Fetch_before && !added)
+		chan->fetchedall = 1;
+	else if (fetch == Fetch_after && added)
+		serv_chathistory(server, chan, Fetch_after, batch->last);
+}
+
+/* netsplit, netjoin and chathistory batches are held by handle()
+ * until they end, then dealt with at once. Other types are handled as they come, a
+ * labeled-response one is only noted so its replies find their request. */
+HANDLER(
+handle_BATCH) {
+	struct Batch *batch;
+	char *ref;
+
+	assert_warn(param_len(msg->params) >= 2,);
+
+	ref = *(msg->params+1);
+	if (*ref == '+' && param_len(msg->params) >= 3) {
+		if (strcmp(*(msg->params+2), "netsplit") == 0 ||
+				strcmp(*(msg->params+2), "netjoin") == 0 ||
+				strcmp(*(msg->params+2), "chathistory") == 0)
+			serv_batch_open(server, ref + 1, *(msg->params+2), msg->params+3, msg->timestamp);
+		else if (strcmp(*(msg->params+2), "labeled-response") == 0)
+			expect_batch(server, msg->tags, ref + 1);
+	} else if (*ref == '-') {
+		if ((batch = serv_batch_get(server, ref + 1))) {
+			if (strcmp(batch->type, "netsplit") == 0)
+				handle_netsplit(server, batch);
+			else if (strcmp(batch->type, "netjoin") == 0)
+				handle_netjoin(server, batch, 0);
+			else
+				handle_chathistory(server, batch);
+			serv_batch_close(server, batch);
+		}
+		expect_done(server, NULL, ref + 1);
+	}
+}
+
+/* FAIL <command> <code> [context...] :<description> */
+HANDLER(
+handle_FAIL) {
+	char **p;
+	int named = 0;
+
+	if (param_len(msg->params) > 3 && strcmp(*(msg->params+1), "CHATHISTORY") == 0) {
+		/* which buffer it's about is somewhere in
+		 * the context, if the server says at all */
+		for (p = msg->params + 3; *p && *(p+1); p++)
+			named |= serv_chathistory_done(server, *p);
+		if (!named)
+			serv_chathistory_done(server, NULL);
+	}
+	hist_addp(server->history, msg, Activity_error, HIST_DFL|HIST_SERR);
+}
+
+/*
+ * Servers without BATCH still send a netsplit as a storm of QUITs, each
+ * with the two servers as the reason. Those are held in a batch of our
+ * own for netsplit.wait seconds after the last one, and then dealt with
+ * as if the server had sent it. The nicks are kept for netsplit.rejoin
+ * seconds after that, so their JOINs can be held the same way. These
+ * refs have spaces in, so they can't clash with one from the server.
+ */
+
+static int
+handle_splitserver(char *s, size_t len) {
+	size_t i;
+	int dot = 0;
+
+	if (!len || *s == '.' || s[len - 1] == '.')
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (s[i] == '.') {
+			if (s[i + 1] == '.')
+				return 0;
+			dot = 1;
+		} else if (!isalnum((unsigned char)s[i]) && s[i] != '-' && s[i] != '*') {
+			return 0;
+		}
+	}
+	return dot;
+}
+
+/* "hub.example.net leaf.example.net" */
+static int
+handle_splitreason(char *reason) {
+	char *sp;
+	size_t len;
+
+	if (!reason || !(sp = strchr(reason, ' ')) || strchr(sp + 1, ' '))
+		return 0;
+	len = sp - reason;
+	return handle_splitserver(reason, len) &&
+		handle_splitserver(sp + 1, strlen(sp + 1)) &&
+		(len != strlen(sp + 1) || strncmp(reason, sp + 1, len) != 0);
+}
+
+static void
+handle_hold(struct Server *server, char *ref, char *type, char **params, struct History *msg) {
+	struct Batch *batch;
+	struct History *p;
+
+	if (!(batch = serv_batch_get(server, ref)))
+		batch = serv_batch_open(server, ref, type, params, msg->timestamp);
+
+	p = hist_create(server->history, NULL, msg->raw, 0, msg->timestamp, 0);
+	if (msg->tags)
+		p->tags = estrdup(msg->tags);
+	serv_batch_add(batch, p);
+	batch->expires = time(NULL) + config_getl("netsplit.wait");
+}
+
+static int
+handle_splitquit(struct Server *server, struct History *msg) {
+	char ref[512], **params;
+
+	if (!config_getl("netsplit.wait") || param_len(msg->params) < 2 ||
+			!handle_splitreason(*(msg->params+1)))
+		return 0;
+
+	snprintf(ref, sizeof(ref), "netsplit %s", *(msg->params+1));
+	params = param_create(*(msg->params+1));
+	handle_hold(server, ref, "netsplit", params, msg);
+	param_free(params);
+	return 1;
+}
+
+/* A guessed batch's time is up */
+static void
+handle_guessed(struct Server *server, struct Batch *batch) {
+	struct History *p;
+	char ref[512];
+	size_t n;
+
+	if (strncmp(batch->ref, "netsplit ", CONSTLEN("netsplit ")) == 0) {
+		handle_netsplit(server, batch);
+		if (!config_getl("netsplit.rejoin")) {
+			serv_batch_close(server, batch);
+			return;
+		}
+
+		for (n = 0, p = batch->msgs; p; p = p->next)
+			n++;
+		batch->nicks = emalloc((n ? n : 1) * sizeof(char *));
+		for (p = batch->msgs; p; p = p->next)
+			if (p->from && p->from->nick)
+				batch->nicks[batch->len++] = p->from->nick;
+		handle_casemap = server->isupport.casemap;
+		qsort(batch->nicks, batch->len, sizeof(char *), handle_nickcmp);
+
+		snprintf(ref, sizeof(ref), "rejoin %s", batch->ref + CONSTLEN("netsplit "));
+		pfree(&batch->ref);
+		batch->ref = estrdup(ref);
+		batch->expires = time(NULL) + config_getl("netsplit.rejoin");
+	} else {
+		if (strncmp(batch->ref, "netjoin ", CONSTLEN("netjoin ")) == 0)
+			handle_netjoin(server, batch, 1);
+		serv_batch_close(server, batch);
+	}
+}
+
+static int
+handle_rejoin(struct Server *server, struct History *msg) {
+	struct Batch *b, *next;
+	struct Channel *chan;
+	char ref[512];
+
+	if (!config_getl("netsplit.wait") || nick_isself(msg->from))
+		return 0;
+
+	/* anyone joining may be in a split that's still held,
+	 * which must be dealt with first or they'd be removed */
+	for (b = server->batches; b; b = next) {
+		next = b->next;
+		if (b->expires && strncmp(b->ref, "netsplit ", CONSTLEN("netsplit ")) == 0)
+			handle_guessed(server, b);
+	}
+
+	if (!(chan = chan_get(&server->channels, *(msg->params+1), -1)))
+		return 0;
+	handle_casemap = server->isupport.casemap;
+	for (b = server->batches; b; b = b->next)
+		if (b->nicks && bsearch(&msg->from->nick, b->nicks, b->len, sizeof(char *), handle_nickcmp))
+			break;
+	if (!b)
+		return 0;
+
+	snprintf(ref, sizeof(ref), "netjoin %s", b->ref + CONSTLEN("rejoin "));
+	handle_hold(server, ref, "netjoin", b->params, msg);
+
+	/* Only the line waits. The MODE giving back their privileges
+	 * comes straight after, and they may PART, QUIT or change nick
+	 * before the batch is done, all of which need them to be here. */
+	if (nick_get(&chan->nicks, msg->from->nick, server) == NULL)
+		nick_add(&chan->nicks, msg->from->prefix, ' ', server);
+	if (selected.channel == chan)
+		windows[Win_nicklist].refresh = 1;
+	return 1;
+}
+
+/* Deal with guessed batches whose time is up */
+void
+handle_batch_expire(struct Server *server) {
+	struct Batch *b, *next;
+	time_t now;
+
+	now = time(NULL);
+	for (b = server->batches; b; b = next) {
+		next = b->next;
+		if (b->expires && b->expires <= now)
+			handle_guessed(server, b);
+	}
+}
+
 HANDLER(
 handle_MODE) {
 	struct Channel *chan;
@@ -199,9 +728,8 @@ handle_MODE) {
 		expect_set(server, Expect_nosuchnick, NULL);
 		hist_addp(server->history, msg, Activity_status, HIST_LOG);
 		hist_addp(chan->history, msg, Activity_status, HIST_DFL);
-		serv_write(server, Sched_now, "MODE %s\r\n", chan->name); /* Get full mode via RPL_CHANNELMODEIS
-						                           * instead of concatenating manually */
-		serv_write(server, Sched_now, "NAMES %s\r\n", chan->name); /* Also get updated priviledges */
+		if (chan_mode(server, chan, msg->params+2) && selected.channel == chan)
+			windows[Win_nicklist].refresh = 1;
 	} else {
 		hist_addp(server->history, msg, Activity_status, HIST_DFL);
 	}
@@ -224,7 +752,7 @@ handle_PRIVMSG) {
 	if (strchr(nick->nick, '.')) {
 		/* it's a server */
 		hist_addp(server->history, msg, Activity_status, HIST_DFL);
-	} else if (strcmp_n(target, server->self->nick) == 0) {
+	} else if (serv_casecmp(server, target, server->self->nick) == 0) {
 		/* it's messaging me */
 		if ((chan = chan_get(&server->queries, nick->nick, -1)) == NULL)
 			chan = chan_add(server, &server->queries, nick->nick, 1);
@@ -310,11 +838,12 @@ handle_RPL_CHANNELMODEIS) {
 	if ((chan = chan_get(&server->channels, *(msg->params+2), -1)) == NULL)
 		chan = chan_add(server, &server->channels, *(msg->params+2), 0);
 
+	/* replaces all but list modes, which aren't kept anyway */
 	pfree(&chan->mode);
-	chan->mode = estrdup(*(msg->params+3));
+	chan_mode(server, chan, msg->params+3);
 
 	hist_addp(server->history, msg, Activity_status, HIST_LOG);
-	if (expect_get(server, Expect_channelmodeis)) {
+	if (expect_msg(server, msg, Expect_channelmodeis)) {
 		hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 		expect_set(server, Expect_channelmodeis, NULL);
 	} else {
@@ -339,9 +868,10 @@ handle_RPL_NAMREPLY) {
 	struct Channel *chan;
 	struct Nick *oldnick;
 	char **params = msg->params;
-	char *nick, priv, *target;
+	char *nick, *target;
+	char name[128];
+	size_t len;
 	char **nicks, **nicksref;
-	char *supportedprivs;
 
 	assert_warn(param_len(params) >= 5,);
 
@@ -353,31 +883,29 @@ handle_RPL_NAMREPLY) {
 	if ((chan = chan_get(&server->channels, target, -1)) == NULL)
 		chan = chan_add(server, &server->channels, target, 0);
 
-	if (strcmp_n(target, expect_get(server, Expect_names)) == 0)
+	if (serv_casecmp(server, target, expect_msg(server, msg, Expect_names)) == 0)
 		hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 	else
 		hist_addp(chan->history, msg, Activity_status, HIST_LOG);
 
 	params++;
-	supportedprivs = strchr(support_get(server, "PREFIX"), ')');
-	if (supportedprivs == NULL || supportedprivs[0] == '\0')
-		supportedprivs = "";
-	else
-		supportedprivs++;
-
 	nicksref = nicks = param_create(*params);
+	/* With multi-prefix, each nick has all its prefixes, and
+	 * with userhost-in-names it is a full nick!user@host */
 	for (; *nicks && **nicks; nicks++) {
-		priv = ' ';
 		nick = *nicks;
-		if (strchr(supportedprivs, **nicks)) {
-			priv = **nicks;
-			while (strchr(supportedprivs, *nick))
-				nick++;
+		while (server->isupport.rank[(unsigned char)*nick])
+			nick++;
+		len = strcspn(nick, "!");
+		snprintf(name, sizeof(name), "%.*s", (int)len, nick);
+		if ((oldnick = nick_get(&chan->nicks, name, server)) != NULL && nick[len] && !oldnick->host) {
+			nick_remove(&chan->nicks, name, server);
+			oldnick = NULL;
 		}
-		if ((oldnick = nick_get(&chan->nicks, nick)) == NULL)
-			nick_add(&chan->nicks, nick, priv, server);
-		else
-			oldnick->priv = priv;
+		if (oldnick == NULL)
+			oldnick = nick_add(&chan->nicks, nick, ' ', server);
+		if (oldnick)
+			nick_setprivs(oldnick, server, *nicks, nick - *nicks);
 	}
 
 	if (selected.channel == chan)
@@ -393,7 +921,7 @@ handle_RPL_ENDOFNAMES) {
 	assert_warn(param_len(msg->params) >= 3,);
 
 	target = *(msg->params+2);
-	if (strcmp_n(target, expect_get(server, Expect_names)) == 0)
+	if (serv_casecmp(server, target, expect_msg(server, msg, Expect_names)) == 0)
 		expect_set(server, Expect_names, NULL);
 }
 
@@ -402,7 +930,7 @@ handle_ERR_NOSUCHNICK) {
 	char *expectation;
 	struct Channel *chan = NULL;
 
-	if ((expectation = expect_get(server, Expect_nosuchnick)) != NULL) {
+	if ((expectation = expect_msg(server, msg, Expect_nosuchnick)) != NULL) {
 		chan = chan_get(&server->channels, expectation, -1);
 		expect_set(server, Expect_nosuchnick, NULL);
 	}
@@ -410,6 +938,21 @@ handle_ERR_NOSUCHNICK) {
 	hist_addp(chan ? chan->history : server->history, msg, Activity_error, HIST_DFL|HIST_SERR);
 }
 
+/* <client> <channel> :<reason>, for a join that won't happen.
+ * 470 is <client> <channel> <forward> :<reason>, the JOIN that follows
+ * is for <forward>, so <channel> is just as done with. */
+HANDLER(
+handle_ERR_CANTJOIN) {
+	struct Channel *chan = NULL;
+
+	if (param_len(msg->params) >= 3) {
+		serv_join_failed(server, *(msg->params+2));
+		chan = chan_get(&server->channels, *(msg->params+2), -1);
+	}
+
+	hist_addp(chan ? chan->history : server->history, msg, Activity_error, HIST_DFL|HIST_SERR);
+}
+
 HANDLER(
 handle_ERR_NICKNAMEINUSE) {
 	char nick[64]; /* should be limited to 9 chars, but newer servers *shrug*/
@@ -417,7 +960,7 @@ handle_ERR_NICKNAMEINUSE) {
 
 	hist_addp(server->history, msg, Activity_status, HIST_DFL);
 
-	if (expect_get(server, Expect_nicknameinuse) == NULL) {
+	if (expect_msg(server, msg, Expect_nicknameinuse) == NULL) {
 		snprintf(nick, sizeof(nick), "%s_", server->self->nick);
 		nnick = nick_create(nick, ' ', server);
 		nick_free(server->self);
@@ -434,8 +977,8 @@ handle_NICK) {
 	struct Nick *nick, *chnick;
 	struct Channel *chan;
 	char prefix[128];
+	char privs[sizeof(nick->privs)];
 	char *newnick;
-	char priv;
 
 	assert_warn(msg->from && *msg->params && *(msg->params+1),);
 
@@ -454,12 +997,13 @@ handle_NICK) {
 	}
 
 	for (chan = server->channels; chan; chan = chan->next) {
-		if ((chnick = nick_get(&chan->nicks, nick->nick)) != NULL) {
+		if ((chnick = nick_get(&chan->nicks, nick->nick, server)) != NULL) {
 			snprintf(prefix, sizeof(prefix), ":%s!%s@%s",
 					newnick, chnick->ident, chnick->host);
-			priv = chnick->priv;
-			nick_remove(&chan->nicks, nick->nick);
-			nick_add(&chan->nicks, prefix, priv, server);
+			memcpy(privs, chnick->privs, sizeof(privs));
+			nick_remove(&chan->nicks, nick->nick, server);
+			if ((chnick = nick_add(&chan->nicks, prefix, ' ', server)))
+				nick_setprivs(chnick, server, privs, strlen(privs));
 			hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 			if (selected.channel == chan)
 				windows[Win_nicklist].refresh = 1;
@@ -493,7 +1037,7 @@ handle_RPL_NOTOPIC) {
 	if ((chan = chan_get(&server->channels, target, -1)) == NULL)
 		return;
 
-	if (strcmp_n(target, expect_get(server, Expect_topic)) == 0) {
+	if (serv_casecmp(server, target, expect_msg(server, msg, Expect_topic)) == 0) {
 		hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 		expect_set(server, Expect_topic, NULL);
 	} else {
@@ -519,7 +1063,7 @@ handle_RPL_TOPIC) {
 	pfree(&chan->topic);
 	chan->topic = topic ? estrdup(topic) : NULL;
 
-	if (strcmp_n(target, expect_get(server, Expect_topic)) == 0) {
+	if (serv_casecmp(server, target, expect_msg(server, msg, Expect_topic)) == 0) {
 		hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 		expect_set(server, Expect_topic, NULL);
 		expect_set(server, Expect_topicwhotime, target);
@@ -542,7 +1086,7 @@ handle_RPL_TOPICWHOTIME) {
 	if ((chan = chan_get(&server->channels, target, -1)) == NULL)
 		return;
 
-	if (strcmp_n(target, expect_get(server, Expect_topicwhotime)) == 0) {
+	if (serv_casecmp(server, target, expect_msg(server, msg, Expect_topicwhotime)) == 0) {
 		hist_addp(chan->history, msg, Activity_status, HIST_DFL);
 		expect_set(server, Expect_topicwhotime, NULL);
 	} else {
@@ -552,9 +1096,11 @@ handle_RPL_TOPICWHOTIME) {
 
 HANDLER(
 handle_RPL_WELCOME) {
+	server->capneg = 0;
 	if (server->status != ConnStatus_connected) {
 		/* XXX: unify this with RPL_ENDOFMOTD */
 		server->status = ConnStatus_connected;
+		server->connected = time(NULL);
 		serv_auto_send(server);
 		schedule_send(server, Sched_connected);
 	}
@@ -586,6 +1132,7 @@ handle_RPL_ENDOFMOTD) {
 	/* If server doesn't support RPL_WELCOME, use RPL_ENDOFMOTD to set status */
 	if (server->status != ConnStatus_connected) {
 		server->status = ConnStatus_connected;
+		server->connected = time(NULL);
 		serv_auto_send(server);
 		schedule_send(server, Sched_connected);
 	}
@@ -601,12 +1148,45 @@ handle_logonly(struct Server *server, struct History *msg) {
 void
 handle(struct Server *server, char *msg) {
 	struct History *hist;
+	struct Batch *batch;
 	time_t timestamp;
+	char *tags = NULL, ref[64];
+
+	/* Tags are split off here, so that the rest is
+	 * parsed the same as it would be without them */
+	if (*msg == '@') {
+		tags = msg + 1;
+		msg += strcspn(msg, " ");
+		if (*msg)
+			*msg++ = '\0';
+		while (*msg == ' ')
+			msg++;
+	}
+
+	/* when it was sent, not when it reached us: playback
+	 * from a bouncer is hours old. hist_add() puts it in order */
+	if (!(timestamp = tag_time(tags)))
+		timestamp = time(NULL);
+
+	if (server->batches && tag_gets(tags, "batch", ref, sizeof(ref)) &&
+			(batch = serv_batch_get(server, ref))) {
+		hist = hist_create(server->history, NULL, msg, 0, timestamp, 0);
+		hist->tags = estrdup(tags);
+		serv_batch_add(batch, hist);
+		return;
+	}
+
+	handle_msg(server, msg, tags, timestamp);
+}
+
+static void
+handle_msg(struct Server *server, char *msg, char *tags, time_t timestamp) {
+	struct History *hist;
+	struct Tag tag;
 	char **params;
 	char *cmd;
 	int i;
 
-	timestamp = time(NULL);
 	params = param_create(msg);
 	if (!*params) {
 		pfree(&params);
@@ -624,6 +1204,8 @@ handle(struct Server *server, char *msg) {
 				/* histinfo set to the server's history
 				 * currently, but not actually appended */
 				hist = hist_create(server->history, NULL, msg, 0, timestamp, 0);
+				if (tags)
+					hist->tags = estrdup(tags);
 				handlers[i].func(server, hist);
 				hist_free(hist);
 			}
@@ -634,10 +1216,15 @@ handle(struct Server *server, char *msg) {
 
 	/* add it to server->history if there is no handler */
 	if (*cmd == '4' && *cmd == '5')
-		hist_add(server->history, msg, Activity_error, timestamp, HIST_DFL|HIST_SERR);
+		hist = hist_add(server->history, msg, Activity_error, timestamp, HIST_DFL|HIST_SERR);
 	else
-		hist_add(server->history, msg, Activity_status, timestamp, HIST_DFL);
+		hist = hist_add(server->history, msg, Activity_status, timestamp, HIST_DFL);
+	if (hist && tags)
+		hist->tags = estrdup(tags);
 
 end:
+	/* a lone labeled reply is the only one, more come in a BATCH */
+	if (server->labels && cmd && strcmp(cmd, "BATCH") != 0 && tag_get(tags, "label", &tag))
+		expect_done(server, tags, NULL);
 	param_free(params);
 }
@@ -21,6 +21,7 @@
 #define H_HIRC
 
 #include <wchar.h>
+#include <sys/uio.h>
 #include "struct.h"
 #define PARAM_MAX 64
 #define INPUT_MAX 8192
@@ -53,18 +54,27 @@ void		cleanup(char *quitmsg);
 /* params.c */
 void		param_free(char **params);
 int		param_len(char **params);
+char **		param_dup(char **params);
 char **		param_create(char *msg);
+int		tag_next(char **tags, struct Tag *tag);
+int		tag_get(char *tags, char *key, struct Tag *tag);
+char *		tag_value(struct Tag *tag, char *buf, size_t size);
+char *		tag_gets(char *tags, char *key, char *buf, size_t size);
+time_t		tag_time(char *tags);
 
 /* str.c */
 wchar_t * 	stowc(char *str);
 char * 		wctos(wchar_t *str);
 char *		homepath(char *path);
 int		strcmp_n(const char *s1, const char *s2);
+int		strcmp_fold(enum Casemap map, const char *s1, const char *s2);
+unsigned long long strhash_fold(enum Casemap map, const char *str);
 char *		struntil(char *str, char until);
 int		strisnum(char *str, int allowneg);
 char *		strntok(char *str, char *sep, int n);
 char *		strrdate(time_t secs);
 char *		smprintf(size_t len, char *fmt, ...);
+size_t		strwrap(char *str, size_t max, char **next);
 
 /* mem.c */
 void		pfree_(void **ptr);
@@ -87,6 +97,7 @@ void 		chan_setold(struct Channel *channel, int old);
 /* struct Channel *chan_dup(struct Channel *channel); */
 int		chan_remove(struct Channel **head, char *name);
 int		chan_selected(struct Channel *channel);
+int		chan_mode(struct Server *server, struct Channel *chan, char **params);
 
 /* nick.c */
 void		prefix_tokenize(char *prefix, char **nick, char **ident, char **host);
@@ -94,17 +105,23 @@ short		nick_getcolour(struct Nick *nick);
 void		nick_free(struct Nick *nick);
 void		nick_free_list(struct Nick **head);
 struct Nick *	nick_create(char *prefix, char priv, struct Server *server);
-struct Nick *	nick_get(struct Nick **head, char *nick);
+struct Nick *	nick_get(struct Nick **head, char *nick, struct Server *server);
 struct Nick *	nick_add(struct Nick **head, char *prefix, char priv, struct Server *server);
 struct Nick *	nick_dup(struct Nick *nick);
 int		nick_isself(struct Nick *nick);
 int		nick_isself_server(struct Nick *nick, struct Server *server);
-int		nick_remove(struct Nick **head, char *nick);
+int		nick_remove(struct Nick **head, char *nick, struct Server *server);
+void		nick_removep(struct Nick **head, struct Nick *p);
 void		nick_sort(struct Nick **head, struct Server *server);
+void		nick_setpriv(struct Nick *nick, struct Server *server, char priv, int set);
+void		nick_setprivs(struct Nick *nick, struct Server *server, char *privs, size_t len);
 
 /* hist.c */
 void		hist_free(struct History *history);
 void		hist_free_list(struct HistInfo *histinfo);
+void		hist_link(struct HistInfo *histinfo, struct History *new, struct History *after);
+struct History *hist_edge(struct HistInfo *histinfo, int oldest);
+struct History *hist_find(struct HistInfo *histinfo, struct History *p);
 struct History *hist_create(struct HistInfo *histinfo, struct Nick *from, char *msg,
 		enum Activity activity, time_t timestamp, enum HistOpt options);
 struct History *hist_addp(struct HistInfo *histinfo, struct History *p,
@@ -122,8 +139,20 @@ void		hist_purgeopt(struct HistInfo *histinfo, enum HistOpt options);
 /* serv.c */
 void		serv_free(struct Server *server);
 void		serv_connect(struct Server *server);
+void		serv_connect_poll(struct Server *server);
+void		serv_resolved(struct Server *server, struct DNSCache *dns, int ret);
 void		serv_read(struct Server *sp);
+void		serv_event(struct Server *sp);
+int		serv_flush(struct Server *server);
+void		serv_pace(struct Server *server);
+int		serv_linger(void);
+void		serv_lag(struct Server *server);
+int		serv_lag_pong(struct Server *server, char *token);
+long long	serv_lag_get(struct Server *server);
+long long	serv_lag_percentile(struct Server *server, int pct);
 int		serv_write(struct Server *server, enum Sched when, char *format, ...);
+void		serv_message(struct Server *server, struct Channel *chan, char *cmd,
+		char *target, char *text, int action);
 struct Server *	serv_create(char *name, char *host, char *port, char *nick,
 		char *username, char *realname, char *password, int tls, int tls_verify);
 void		serv_update(struct Server *sp, char *nick, char *username,
@@ -132,29 +161,80 @@ struct Server * serv_get(struct Server **head, char *name);
 struct Server * serv_add(struct Server **head, char *name, char *host, char *port, char *nick,
 		char *username, char *realname, char *password, int tls, int tls_verify);
 int		serv_len(struct Server **head);
-int		serv_poll(struct Server **head, int timeout);
 int		serv_remove(struct Server **head, char *name);
 int		serv_selected(struct Server *server);
 void		serv_disconnect(struct Server *server, int reconnect, char *msg);
 int		serv_ischannel(struct Server *server, char *str);
+int		serv_casecmp(struct Server *server, const char *s1, const char *s2);
 void		serv_auto_add(struct Server *server, char *cmd);
 void		serv_auto_free(struct Server *server);
 void		serv_auto_send(struct Server *server);
 int		serv_auto_haschannel(struct Server *server, char *chan);
+void		serv_join(struct Server *server, char *name, char *key);
+void		serv_join_done(struct Server *server, struct Channel *chan);
+void		serv_join_failed(struct Server *server, char *name);
+void		serv_join_clear(struct Server *server, int all);
+void		serv_join_send(struct Server *server);
+void		serv_chathistory(struct Server *server, struct Channel *chan, enum Fetch fetch, struct History *from);
+int		serv_chathistory_done(struct Server *server, char *target);
+struct Batch *	serv_batch_open(struct Server *server, char *ref, char *type, char **params, time_t timestamp);
+struct Batch *	serv_batch_get(struct Server *server, char *ref);
+void		serv_batch_add(struct Batch *batch, struct History *msg);
+void		serv_batch_close(struct Server *server, struct Batch *batch);
+void		serv_batch_clear(struct Server *server);
 char *		support_get(struct Server *server, char *key);
 void		support_set(struct Server *server, char *key, char *value);
+void		support_reset(struct Server *server);
 void		schedule(struct Server *server, enum Sched when, char *msg);
 void		schedule_send(struct Server *server, enum Sched when);
 void		expect_set(struct Server *server, enum Expect cmd, char *about);
 char *		expect_get(struct Server *server, enum Expect cmd);
+int		serv_request(struct Server *server, enum Sched when, enum Expect cmd, char *about, char *format, ...);
+char *		expect_msg(struct Server *server, struct History *msg, enum Expect cmd);
+void		expect_batch(struct Server *server, char *tags, char *ref);
+void		expect_done(struct Server *server, char *tags, char *ref);
+void		expect_clear(struct Server *server);
+
+/* input.c */
+void		serv_input_reset(struct Input *in);
+int		serv_input_space(struct Input *in, struct iovec *iov);
+int		serv_input_line(struct Input *in, char **line);
+
+/* event.c */
+void		event_init(void);
+int		event_add(int fd, enum EventOpt want, struct Server *server);
+int		event_watch(int fd, enum EventOpt flag);
+int		event_mod(int fd, enum EventOpt want);
+void		event_del(int fd);
+long long	event_now(void);
+void		event_timer(long ms);
+int		event_wait(void);
+
+/* dns.c */
+void		dns_init(void);
+void		dns_lookup(struct Server *server);
+void		dns_cancel(struct Server *server);
+void		dns_release(struct DNSCache *dc);
+void		dns_expire(struct DNSCache *dc);
+void		dns_read(void);
+
+#ifdef IOTHREAD
+/* io.c */
+void		io_start(struct Server *server);
+void		io_stop(struct Server *server);
+void		io_write(struct Server *server);
+int		io_read(struct Server *server, int *lines, long long deadline);
+#endif /* IOTHREAD */
 
 /* handle.c */
 void		handle(struct Server *server, char *msg);
+void		handle_batch_expire(struct Server *server);
 
 /* ui.c */
 void		ui_init(void);
 #define		ui_deinit() endwin()
 void		ui_read(void);
+void		ui_resize(void);
 void		ui_complete(wchar_t *str, size_t size);
 int		ui_input_insert(char c, int counter);
 int		ui_input_delete(int num, int counter);
@@ -35,6 +35,7 @@ hist_free(struct History *history) {
 	param_free(history->_params);
 	nick_free(history->from);
 	pfree(&history->raw);
+	pfree(&history->tags);
 	pfree(&history->format);
 	pfree(&history->rformat);
 	pfree(&history);
@@ -55,7 +56,72 @@ hist_free_list(struct HistInfo *histinfo) {
 		if (p)
 			p = p->next;
 	}
-	histinfo->history = NULL;
+	histinfo->history = histinfo->oldest = histinfo->placed = NULL;
+	histinfo->len = 0;
+	pfree(&histinfo->seen);
+}
+
+void
+hist_link(struct HistInfo *histinfo, struct History *new, struct History *after) {
+	if (after) {
+		new->prev = after;
+		new->next = after->next;
+		after->next = new;
+	} else {
+		new->prev = NULL;
+		new->next = histinfo->history;
+		histinfo->history = new;
+	}
+
+	if (new->next)
+		new->next->prev = new;
+	else
+		histinfo->oldest = new;
+	histinfo->len++;
+}
+
+static void
+hist_unlink(struct HistInfo *histinfo, struct History *p) {
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		histinfo->history = p->next;
+
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		histinfo->oldest = p->prev;
+
+	if (histinfo->placed == p)
+		histinfo->placed = NULL;
+	histinfo->len--;
+}
+
+/*
+ * Find the entry a message with this timestamp goes after, or NULL for
+ * the head. Most messages are newer than anything in the buffer; those
+ * that aren't (server-time playback) are looked for from where the last
+ * one was placed, as playback arrives in order and lands close by.
+ */
+static struct History *
+hist_place(struct HistInfo *histinfo, time_t timestamp, enum HistOpt options) {
+	struct History *p;
+
+	p = histinfo->history;
+	if (!p || p->timestamp <= timestamp || options & HIST_GREP)
+		return NULL;
+
+	if (histinfo->placed)
+		p = histinfo->placed;
+	if (p->timestamp > timestamp) {
+		while (p->next && p->next->timestamp > timestamp)
+			p = p->next;
+	} else {
+		/* stops at the head at the latest, it's newer */
+		while (p->timestamp <= timestamp)
+			p = p->prev;
+	}
+	return p;
 }
 
 struct History *
@@ -72,6 +138,7 @@ hist_create(struct HistInfo *histinfo, struct Nick *from, char *msg,
 	new->timestamp = timestamp ? timestamp : time(NULL);
 	new->activity = activity;
 	new->raw = estrdup(msg);
+	new->tags = NULL;
 	new->_params = new->params = param_create(msg);
 	new->rformat = new->format = NULL;
 	new->options = options;
@@ -83,7 +150,7 @@ hist_create(struct HistInfo *histinfo, struct Nick *from, char *msg,
 		np = NULL;
 		if (histinfo->channel && histinfo->channel->nicks) {
 			prefix_tokenize(*new->_params, &nick, NULL, NULL);
-			np = nick_get(&histinfo->channel->nicks, nick);
+			np = nick_get(&histinfo->channel->nicks, nick, histinfo->server);
 			free(nick);
 		}
 
@@ -113,9 +180,208 @@ hist_create(struct HistInfo *histinfo, struct Nick *from, char *msg,
 	return new;
 }
 
+static unsigned long long
+hist_fnv(unsigned long long hash, void *data, size_t len) {
+	unsigned char *p;
+
+	for (p = data; len; len--, p++)
+		hash = (hash ^ *p) * 1099511628211ULL;
+	return hash;
+}
+
+/* Hash of the timestamp, nick and params, which are the same whether p
+ * was just received or read back from the log (that has no prefix in raw).
+ * The nick is in whatever case the server and bouncer had at the time. */
+static unsigned long long
+hist_fingerprint(struct History *p) {
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned long long nick;
+	long long timestamp = p->timestamp;
+	char **params;
+
+	hash = hist_fnv(hash, &timestamp, sizeof(timestamp));
+	if (p->from && p->from->nick) {
+		nick = strhash_fold(p->origin && p->origin->server ?
+				p->origin->server->isupport.casemap : Casemap_rfc1459, p->from->nick);
+		hash = hist_fnv(hash, &nick, sizeof(nick));
+	}
+	for (params = p->params; params && *params; params++)
+		hash = hist_fnv(hash, *params, strlen(*params) + 1);
+	return hash ? hash : 1; /* 0 is an empty slot */
+}
+
+static int
+hist_seen_has(struct HistSeen *seen, unsigned long long fp) {
+	size_t i;
+	int set;
+
+	for (set = 0; set < 2; set++)
+		for (i = fp % (HIST_SEEN * 2); seen->set[set][i]; i = (i + 1) % (HIST_SEEN * 2))
+			if (seen->set[set][i] == fp)
+				return 1;
+	return 0;
+}
+
+/* Fingerprint of the msgid in tags, 0 if there is none */
+static unsigned long long
+hist_msgid(char *tags) {
+	unsigned long long hash = 14695981039346656037ULL;
+	char id[128];
+
+	if (!tag_gets(tags, "msgid", id, sizeof(id)) || !*id)
+		return 0;
+	hash = hist_fnv(hash, "msgid=", CONSTLEN("msgid="));
+	hash = hist_fnv(hash, id, strlen(id));
+	return hash ? hash : 1;
+}
+
+/*
+ * Remember a fingerprint for hist_seen(). Each set is kept at most half
+ * full, and when the current one has HIST_SEEN fingerprints the older
+ * is emptied and becomes current, so the newest HIST_SEEN or more are
+ * remembered.
+ */
+static void
+hist_seen_insert(struct HistInfo *histinfo, unsigned long long fp) {
+	struct HistSeen *seen;
+	size_t i;
+
+	if (!histinfo->seen) {
+		histinfo->seen = emalloc(sizeof(struct HistSeen));
+		memset(histinfo->seen, 0, sizeof(struct HistSeen));
+	}
+	seen = histinfo->seen;
+	if (hist_seen_has(seen, fp))
+		return;
+
+	if (seen->len == HIST_SEEN) {
+		seen->cur = !seen->cur;
+		memset(seen->set[seen->cur], 0, sizeof(seen->set[seen->cur]));
+		seen->len = 0;
+	}
+	for (i = fp % (HIST_SEEN * 2); seen->set[seen->cur][i]; i = (i + 1) % (HIST_SEEN * 2));
+	seen->set[seen->cur][i] = fp;
+	seen->len++;
+}
+
+static void
+hist_seen_add(struct HistInfo *histinfo, struct History *p) {
+	if (histinfo->server && !(p->options & (HIST_TMP|HIST_GREP)) &&
+			strncmp(p->raw, "SELF_", CONSTLEN("SELF_")) != 0)
+		hist_seen_insert(histinfo, hist_fingerprint(p));
+}
+
+/* Was a message with this fingerprint already added to, or restored
+ * from the log into, histinfo? */
+static int
+hist_seen(struct HistInfo *histinfo, unsigned long long fp) {
+	return histinfo->seen && hist_seen_has(histinfo->seen, fp);
+}
+
 struct History *
 hist_addp(struct HistInfo *histinfo, struct History *p, enum Activity activity, enum HistOpt options) {
-	return hist_add(histinfo, p->raw, activity, p->timestamp, options);
+	struct History *new;
+	unsigned long long id;
+
+	/*
+	 * A bouncer plays back what it has on every connect, much of which
+	 * is already here. A msgid tells for sure. Without one, anything
+	 * said before we connected is playback, and is looked for by its
+	 * fingerprint, which also finds it among lines restored from the
+	 * log (they keep no msgid). Live messages are never dropped by
+	 * fingerprint: the same line may well be said twice in a second.
+	 */
+	id = hist_msgid(p->tags);
+	if (id && hist_seen(histinfo, id))
+		return NULL;
+	if (histinfo->server && histinfo->server->connected &&
+			p->timestamp < histinfo->server->connected &&
+			hist_seen(histinfo, hist_fingerprint(p)))
+		return NULL;
+
+	if ((new = hist_add(histinfo, p->raw, activity, p->timestamp, options)) && p->tags) {
+		new->tags = estrdup(p->tags);
+		if (id && histinfo->server)
+			hist_seen_insert(histinfo, id);
+	}
+	return new;
+}
+
+/* The newest, or oldest, entry that came from the server */
+struct History *
+hist_edge(struct HistInfo *histinfo, int oldest) {
+	struct History *p;
+
+	for (p = oldest ? histinfo->oldest : histinfo->history; p; p = oldest ? p->prev : p->next)
+		if (!(p->options & (HIST_TMP|HIST_GREP)) && strncmp(p->raw, "SELF_", CONSTLEN("SELF_")) != 0)
+			return p;
+	return NULL;
+}
+
+static int
+hist_sameparams(char **a, char **b) {
+	for (; *a && *b; a++, b++)
+		if (strcmp(*a, *b) != 0)
+			return 0;
+	return !*a && !*b;
+}
+
+static int
+hist_samefrom(struct HistInfo *histinfo, struct History *a, struct History *b) {
+	if (!a->from || !b->from)
+		return a->from == b->from;
+	return serv_casecmp(histinfo->server, a->from->nick, b->from->nick) == 0;
+}
+
+/*
+ * An entry that's the same message as p: with the same msgid, or
+ * failing that from the same nick with the same params within a
+ * second, as our own messages are stamped by us. Only entries around
+ * where p would go are looked at, found the same way as hist_add()
+ * finds it.
+ */
+struct History *
+hist_find(struct HistInfo *histinfo, struct History *p) {
+	struct History *q, *after;
+	char id[128], qid[128];
+	int hasid;
+
+	hasid = tag_gets(p->tags, "msgid", id, sizeof(id)) != NULL;
+	after = hist_place(histinfo, p->timestamp + 1, 0);
+
+	for (q = after ? after->next : histinfo->history; q && q->timestamp >= p->timestamp - 1; q = q->next) {
+		if (q->options & (HIST_TMP|HIST_GREP))
+			continue;
+		if (hasid && tag_gets(q->tags, "msgid", qid, sizeof(qid)))  {
+			if (strcmp(id, qid) == 0)
+				return q;
+		} else if (hist_sameparams(p->params, q->params) && hist_samefrom(histinfo, p, q)) {
+			return q;
+		}
+	}
+	return NULL;
+}
+
+static int
+hist_sameday(time_t a, time_t b) {
+	struct tm atm, btm;
+
+	localtime_r(&a, &atm);
+	localtime_r(&b, &btm);
+	return atm.tm_mday == btm.tm_mday && atm.tm_mon == btm.tm_mon && atm.tm_year == btm.tm_year;
+}
+
+static void
+hist_newday(struct HistInfo *histinfo, time_t day) {
+	struct tm tm;
+	char msg[64];
+
+	localtime_r(&day, &tm);
+	tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+	tm.tm_isdst = -1;
+	day = mktime(&tm);
+	snprintf(msg, sizeof(msg), "SELF_NEW_DAY %lld :day changed to", (long long)day);
+	hist_add(histinfo, msg, Activity_status, day, histinfo->server ? HIST_DFL : HIST_SHOW);
 }
 
 struct History *
@@ -123,10 +389,8 @@ hist_add(struct HistInfo *histinfo,
 		char *msg, enum Activity activity,
 		time_t timestamp, enum HistOpt options) {
 	struct Nick *from = NULL;
-	struct History *new, *p;
+	struct History *new, *after, *older, *p;
 	struct Ignore *ign;
-	struct tm ptm, ctm;
-	int i;
 
 	assert_warn(histinfo && msg, NULL);
 
@@ -144,7 +408,7 @@ hist_add(struct HistInfo *histinfo,
 
 	if (options & HIST_SELF && histinfo->server) {
 		if (histinfo->channel && histinfo->channel->nicks)
-			from = nick_get(&histinfo->channel->nicks, histinfo->server->self->nick);
+			from = nick_get(&histinfo->channel->nicks, histinfo->server->self->nick, histinfo->server);
 		if (!from)
 			from = histinfo->server->self;
 	}
@@ -166,38 +430,33 @@ hist_add(struct HistInfo *histinfo,
 		}
 	}
 
-	if (strcmp(msg, "SELF_NEW_DAY") != 0 &&
-			histinfo && histinfo->history &&
-			histinfo->history->timestamp < timestamp &&
-			!(histinfo->history->options & HIST_RLOG) &&
-			!(histinfo->history->options & HIST_GREP) &&
-			!(options & HIST_GREP)) {
-		localtime_r(&histinfo->history->timestamp, &ptm);
-		localtime_r(&timestamp, &ctm);
-		if (ptm.tm_mday != ctm.tm_mday || ptm.tm_mon != ctm.tm_mon || ptm.tm_year != ctm.tm_year) {
-			ctm.tm_sec = ctm.tm_min = ctm.tm_hour = 0;
-			hist_format(histinfo, Activity_none, histinfo->server ? HIST_DFL : HIST_SHOW,
-					"SELF_NEW_DAY %lld :day changed to", (long long)mktime(&ctm));
-			histinfo->history->timestamp = mktime(&ctm); /* set timestamp of SELF_NEW_DAY:
-									really hist_format should take a timestamp */
-		}
+	after = hist_place(histinfo, new->timestamp, options);
+	older = after ? after->next : histinfo->history;
+
+	/* a day between new and either neighbour gets a SELF_NEW_DAY,
+	 * which sorts in between them by its midnight timestamp */
+	if (strncmp(msg, "SELF_NEW_DAY ", 13) != 0 && !(options & HIST_GREP)) {
+		if (older && !(older->options & (HIST_RLOG|HIST_GREP)) &&
+				!hist_sameday(older->timestamp, new->timestamp))
+			hist_newday(histinfo, new->timestamp);
+		if (after && !(after->options & HIST_GREP) &&
+				strncmp(after->raw, "SELF_NEW_DAY ", 13) != 0 &&
+				!hist_sameday(after->timestamp, new->timestamp))
+			hist_newday(histinfo, after->timestamp);
+		after = hist_place(histinfo, new->timestamp, options);
 	}
 
-	if (!histinfo->history) {
-		histinfo->history = new;
-		goto ui;
-	}
+	hist_link(histinfo, new, after);
+	if (after)
+		histinfo->placed = new;
+	hist_seen_add(histinfo, new);
 
-	for (i=0, p = histinfo->history; p && p->next; p = p->next, i++);
-	if (i == (HIST_MAX-1)) {
-		pfree(&p->next);
-		p->next = NULL;
+	if (histinfo->len > HIST_MAX && histinfo->oldest != new) {
+		p = histinfo->oldest;
+		hist_unlink(histinfo, p);
+		hist_free(p);
 	}
 
-	new->next = histinfo->history;
-	new->next->prev = new;
-	histinfo->history = new;
-
 ui:
 	if (options & HIST_SHOW &&
 			activity >= Activity_hilight &&
@@ -248,16 +507,7 @@ hist_purgeopt(struct HistInfo *histinfo, enum HistOpt options) {
 	for (; p; p = next) {
 		next = p->next;
 		if (p->options & options) {
-			if (p->prev)
-				p->prev->next = p->next;
-			else
-				histinfo->history = p->next;
-
-			if (p->next)
-				p->next->prev = p->prev;
-			else if (!p->prev)
-				histinfo->history = NULL;
-
+			hist_unlink(histinfo, p);
 			pfree(&p);
 		}
 	}
@@ -441,6 +691,9 @@ hist_loadlog(struct HistInfo *hist, char *server, char *channel) {
 			p->prev = prev;
 		}
 		prev = p;
+		hist->len++;
+		if (i < HIST_SEEN)
+			hist_seen_add(hist, p);
 
 		nick_free(from);
 		pfree(&prefix);
@@ -455,6 +708,8 @@ hist_loadlog(struct HistInfo *hist, char *server, char *channel) {
 		p->next = head;
 		head->prev = p;
 		head = p;
+		hist->oldest = prev;
+		hist->len++;
 	}
 	return head;
 }
@@ -0,0 +1,149 @@
+/*
+ * src/input.c from hirc
+ *
+ * Copyright (c) 2021-2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#include "hirc.h"
+
+/* Size of the input ring, see serv_read(). It must hold at least one line
+ * of INPUT_LINE_MAX, plus room to read into. */
+#define INPUT_BUF 16384
+
+/* Longest lines accepted from the server: IRCv3 allows 8191 bytes of tags
+ * (including '@' and the space) on top of the 512 of RFC1459. */
+#define INPUT_TAGS_MAX 8191
+#define INPUT_LINE_MAX (INPUT_TAGS_MAX + 512)
+
+/* Find the first '\n' in buf, like memchr() */
+static char *
+serv_eol(char *buf, size_t n) {
+#ifdef __SSE2__
+	__m128i lf = _mm_set1_epi8('\n');
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((__m128i *)&buf[i]), lf));
+		if (mask)
+			return &buf[i + __builtin_ctz(mask)];
+	}
+	return memchr(&buf[i], '\n', n - i);
+#else
+	return memchr(buf, '\n', n);
+#endif /* __SSE2__ */
+}
+
+/*
+ * Server input is kept in a ring of INPUT_BUF bytes: in->head is the start
+ * of the first line not yet handled, and in->len bytes follow it. Lines end
+ * in "\n" or "\r\n", and are returned where they lie in the ring, with the
+ * line ending replaced by '\0'. The ring is followed by another INPUT_BUF
+ * bytes, so that a line that wraps round the end can be made contiguous by
+ * copying only the part that wrapped.
+ *
+ * These functions only touch *in, so that they can be used by io.c, and
+ * by misc/framebench.
+ */
+void
+serv_input_reset(struct Input *in) {
+	if (!in->buf)
+		in->buf = emalloc(INPUT_BUF * 2);
+	in->head = in->len = in->scan = 0;
+	in->discard = in->more = 0;
+}
+
+/* Point iov at the free space in the ring: after the data up to the end,
+ * and then before in->head if the data doesn't wrap. Returns iovcnt. */
+int
+serv_input_space(struct Input *in, struct iovec *iov) {
+	size_t tail;
+
+	tail = (in->head + in->len) % INPUT_BUF;
+	iov[0].iov_base = &in->buf[tail];
+	if (tail >= in->head && in->len) {
+		iov[0].iov_len = INPUT_BUF - tail;
+		iov[1].iov_base = in->buf;
+		iov[1].iov_len = in->head;
+		return in->head ? 2 : 1;
+	}
+	iov[0].iov_len = (in->len ? in->head : INPUT_BUF) - tail;
+	return 1;
+}
+
+/* Take the next line from the ring. Returns 1 if there was one, 0 if
+ * there isn't a whole line yet, and -1 if a line was discarded for being
+ * longer than INPUT_LINE_MAX or having more than INPUT_TAGS_MAX bytes of
+ * tags. The line is valid until more is read into the ring. */
+int
+serv_input_line(struct Input *in, char **line) {
+	char *p;
+	size_t i, n, len;
+
+	while (in->scan < in->len) {
+		i = (in->head + in->scan) % INPUT_BUF;
+		n = in->len - in->scan;
+		if (n > INPUT_BUF - i)
+			n = INPUT_BUF - i;
+		if ((p = serv_eol(&in->buf[i], n)) == NULL) {
+			in->scan += n;
+			if (in->scan > INPUT_LINE_MAX) {
+				/* drop what we have, and the rest when it comes */
+				in->head = (in->head + in->scan) % INPUT_BUF;
+				in->len -= in->scan;
+				in->scan = 0;
+				if (!in->discard) {
+					in->discard = 1;
+					return -1;
+				}
+			}
+			continue;
+		}
+		in->scan += p - &in->buf[i] + 1;
+
+		if (in->head + in->scan > INPUT_BUF)
+			memcpy(&in->buf[INPUT_BUF], in->buf, in->head + in->scan - INPUT_BUF);
+		*line = &in->buf[in->head];
+		len = in->scan - 1;
+		if (len && (*line)[len - 1] == '\r')
+			len--;
+		(*line)[len] = '\0';
+
+		in->head = (in->head + in->scan) % INPUT_BUF;
+		in->len -= in->scan;
+		in->scan = 0;
+		if (in->len == 0)
+			in->head = 0;
+
+		if (in->discard)
+			in->discard = 0;
+		else if (len + 2 > INPUT_LINE_MAX || (**line == '@' &&
+				((p = memchr(*line, ' ', len)) == NULL || p - *line + 1 > INPUT_TAGS_MAX)))
+			return -1;
+		else if (len)
+			return 1;
+	}
+
+	if (in->len == 0)
+		in->head = 0;
+	return 0;
+}
@@ -0,0 +1,463 @@
+/*
+ * src/io.c from hirc
+ *
+ * Copyright (c) 2021-2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#ifdef TLS
+#include <tls.h>
+#endif /* TLS */
+#include "hirc.h"
+
+/*
+ * Per-server I/O threads.
+ *
+ * With connect.thread set, a connection is handed to a thread of its own
+ * once it is established (and, with TLS, once the handshake is done). The
+ * thread reads, decrypts and splits input into lines, and writes out the
+ * lines it is given. It touches nothing but its struct IOThread: lines are
+ * passed to and from the main thread through two single-producer
+ * single-consumer queues, and each side wakes the other with a pipe. The
+ * main thread watches the notify pipe in place of the socket, so handling
+ * lines, flood control and everything else stays where it was.
+ *
+ * The connection is taken back by io_stop() when disconnecting, and
+ * anything still waiting to be written is handed to serv_linger().
+ */
+
+#define IO_QUEUE 1024  /* lines in each queue */
+#define IO_CHUNK 16384 /* bytes given to one write (the largest TLS record) */
+#define IO_RETRY 10    /* milliseconds before retrying a full queue */
+
+static void
+io_queue_init(struct IOQueue *q) {
+	q->items = emalloc(sizeof(void *) * IO_QUEUE);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+static int
+io_push(struct IOQueue *q, void *item) {
+	size_t tail = atomic_load(&q->tail);
+
+	if (tail - atomic_load(&q->head) == IO_QUEUE)
+		return -1;
+	q->items[tail % IO_QUEUE] = item;
+	atomic_store(&q->tail, tail + 1);
+	return 0;
+}
+
+static int
+io_full(struct IOQueue *q) {
+	return atomic_load(&q->tail) - atomic_load(&q->head) == IO_QUEUE;
+}
+
+static void *
+io_peek(struct IOQueue *q) {
+	size_t head = atomic_load(&q->head);
+
+	if (head == atomic_load(&q->tail))
+		return NULL;
+	return q->items[head % IO_QUEUE];
+}
+
+static void
+io_pop(struct IOQueue *q) {
+	atomic_store(&q->head, atomic_load(&q->head) + 1);
+}
+
+static void
+io_signal(int fd) {
+	char c = 0;
+
+	/* a full pipe is already enough to wake the other side */
+	while (write(fd, &c, 1) == -1 && errno == EINTR);
+}
+
+static void
+io_drain(int fd) {
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+/* In the thread: mark the connection as lost, the main thread does the rest */
+static void
+io_close(struct IOThread *io, const char *error) {
+	if (error)
+		io->error = strdup(error);
+	atomic_store(&io->closed, 1);
+	io_signal(io->notify[1]);
+}
+
+/* In the thread: write lines from io->out until there are none left or the
+ * socket would block. Returns -1 if the connection was lost. */
+static int
+io_send(struct IOThread *io, short *events) {
+	struct Output *o;
+	ssize_t ret;
+
+	for (;;) {
+		/* After TLS_WANT_*, tls_write() must be retried with the same
+		 * data, so io->buf is only refilled once it has been written. */
+		if (io->len == 0) {
+			while ((o = io_peek(&io->out)) && io->len + o->len <= IO_CHUNK) {
+				memcpy(&io->buf[io->len], o->msg, o->len);
+				io->len += o->len;
+				io_pop(&io->out);
+				pfree(&o->msg);
+				pfree(&o);
+			}
+			if (io->len == 0)
+				return 0;
+		}
+
+#ifdef TLS
+		if (io->tls_ctx) {
+			ret = tls_write(io->tls_ctx, io->buf, io->len);
+			if (ret == TLS_WANT_POLLOUT) {
+				*events |= POLLOUT;
+				return 0;
+			} else if (ret == TLS_WANT_POLLIN) {
+				*events |= POLLIN;
+				return 0;
+			} else if (ret == -1) {
+				io_close(io, tls_error(io->tls_ctx));
+				return -1;
+			}
+		} else
+#endif /* TLS */
+		if ((ret = write(io->fd, io->buf, io->len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				*events |= POLLOUT;
+				return 0;
+			}
+			io_close(io, strerror(errno));
+			return -1;
+		}
+		io->len -= ret;
+		memmove(io->buf, &io->buf[ret], io->len);
+	}
+}
+
+/* In the thread: read and split lines into io->in until the socket would
+ * block or io->in is full. Returns -1 if the connection was lost. */
+static int
+io_recv(struct IOThread *io, short *events) {
+	struct iovec iov[2];
+	char *line, *copy;
+	ssize_t ret;
+	int iovcnt, pushed = 0;
+
+	for (;;) {
+		while (!io_full(&io->in) && (ret = serv_input_line(&io->input, &line))) {
+			if (ret == -1) {
+				atomic_fetch_add(&io->dropped, 1);
+			} else if ((copy = strdup(line))) {
+				io_push(&io->in, copy);
+				pushed = 1;
+			}
+		}
+
+		if (io_full(&io->in)) {
+			/* io_read() wakes us once it has made room, the
+			 * check after setting blocked closes the race */
+			atomic_store(&io->blocked, 1);
+			if (io_full(&io->in))
+				break;
+			atomic_store(&io->blocked, 0);
+			continue;
+		}
+
+		iovcnt = serv_input_space(&io->input, iov);
+#ifdef TLS
+		if (io->tls_ctx) {
+			ret = tls_read(io->tls_ctx, iov[0].iov_base, iov[0].iov_len);
+			if (ret == TLS_WANT_POLLIN) {
+				*events |= POLLIN;
+				break;
+			} else if (ret == TLS_WANT_POLLOUT) {
+				*events |= POLLOUT;
+				break;
+			} else if (ret == -1) {
+				io_close(io, tls_error(io->tls_ctx));
+				return -1;
+			}
+		} else
+#endif /* TLS */
+		if ((ret = readv(io->fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				*events |= POLLIN;
+				break;
+			}
+			io_close(io, strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			io_close(io, NULL);
+			return -1;
+		}
+		io->input.len += ret;
+
+		/* let the main thread start on what we have so far */
+		if (pushed) {
+			io_signal(io->notify[1]);
+			pushed = 0;
+		}
+	}
+
+	if (pushed)
+		io_signal(io->notify[1]);
+	return 0;
+}
+
+static void *
+io_thread(void *data) {
+	struct IOThread *io = data;
+	struct pollfd fds[2];
+
+	fds[0].fd = io->fd;
+	fds[1].fd = io->wake[0];
+	fds[1].events = POLLIN;
+
+	while (!atomic_load(&io->stop)) {
+		fds[0].events = 0;
+		if (io_send(io, &fds[0].events) == -1 ||
+				io_recv(io, &fds[0].events) == -1)
+			break;
+		if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+			io_close(io, strerror(errno));
+			break;
+		}
+		if (fds[1].revents)
+			io_drain(io->wake[0]);
+	}
+	return NULL;
+}
+
+static int
+io_pipe(int fds[2]) {
+	if (pipe(fds) == -1)
+		return -1;
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+static void
+io_free(struct IOThread *io) {
+	void *p;
+	int i;
+
+	while ((p = io_peek(&io->in))) {
+		io_pop(&io->in);
+		pfree(&p);
+	}
+	pfree(&io->in.items);
+	pfree(&io->out.items);
+	for (i = 0; i < 2; i++) {
+		if (io->notify[i] != -1)
+			close(io->notify[i]);
+		if (io->wake[i] != -1)
+			close(io->wake[i]);
+	}
+	pfree(&io->input.buf);
+	pfree(&io->buf);
+	pfree(&io->error);
+	pfree(&io);
+}
+
+/* Hand a newly established connection to a thread, if connect.thread is
+ * set. Otherwise, or if the thread can't be started, it stays with the
+ * main thread. */
+void
+io_start(struct Server *server) {
+	struct IOThread *io;
+
+	assert_warn(server && server->rfd != -1,);
+
+	if (!config_getl("connect.thread") || server->io)
+		return;
+
+	io = emalloc(sizeof(struct IOThread));
+	io->fd = server->rfd;
+#ifdef TLS
+	io->tls_ctx = server->tls ? server->tls_ctx : NULL;
+#endif /* TLS */
+	io->notify[0] = io->notify[1] = io->wake[0] = io->wake[1] = -1;
+	io_queue_init(&io->in);
+	io_queue_init(&io->out);
+	atomic_init(&io->stop, 0);
+	atomic_init(&io->closed, 0);
+	atomic_init(&io->blocked, 0);
+	atomic_init(&io->dropped, 0);
+	io->error = NULL;
+	io->input.buf = NULL;
+	serv_input_reset(&io->input);
+	io->buf = emalloc(IO_CHUNK);
+	io->len = 0;
+
+	if (io_pipe(io->notify) == -1 || io_pipe(io->wake) == -1) {
+		ui_perror("pipe()");
+		goto fail;
+	}
+	if (event_add(io->notify[0], EVENT_READ, server) == -1)
+		goto fail;
+	if (pthread_create(&io->thread, NULL, io_thread, io) != 0) {
+		ui_error("cannot start I/O thread for %s", server->name);
+		event_del(io->notify[0]);
+		goto fail;
+	}
+
+	event_del(server->rfd);
+	server->io = io;
+	io_write(server);
+	return;
+
+fail:
+	io_free(io);
+}
+
+/* Wait for the thread to finish and take the connection back.
+ * Lines it hasn't written are returned to the front of server->output. */
+void
+io_stop(struct Server *server) {
+	struct IOThread *io;
+	struct Output *o, *first = NULL, *last = NULL;
+
+	if (!server || !(io = server->io))
+		return;
+
+	atomic_store(&io->stop, 1);
+	io_signal(io->wake[1]);
+	pthread_join(io->thread, NULL);
+	event_del(io->notify[0]);
+	server->io = NULL;
+
+	if (io->len) {
+		o = emalloc(sizeof(struct Output));
+		o->msg = io->buf;
+		o->len = io->len;
+		o->delayed = 0;
+		o->prev = o->next = NULL;
+		first = last = o;
+		io->buf = NULL;
+	}
+	while ((o = io_peek(&io->out))) {
+		io_pop(&io->out);
+		o->prev = last;
+		o->next = NULL;
+		if (last)
+			last->next = o;
+		else
+			first = o;
+		last = o;
+	}
+	for (o = first; o; o = o->next) {
+		server->output.len += o->len;
+		server->output.lines++;
+	}
+	if (first) {
+		last->next = server->output.head;
+		if (server->output.head)
+			server->output.head->prev = last;
+		else
+			server->output.tail = last;
+		server->output.head = first;
+		server->output.off = 0;
+	}
+
+	io_free(io);
+}
+
+/* Hand lines that serv_pace() has let through to the thread */
+void
+io_write(struct Server *server) {
+	struct IOThread *io = server->io;
+	struct Output *o;
+	int pushed = 0;
+
+	while ((o = server->output.head) && io_push(&io->out, o) == 0) {
+		server->output.head = o->next;
+		if (o->next)
+			o->next->prev = NULL;
+		else
+			server->output.tail = NULL;
+		server->output.len -= o->len;
+		server->output.lines--;
+		pushed = 1;
+	}
+
+	if (pushed)
+		io_signal(io->wake[1]);
+	if (server->output.head)
+		event_timer(IO_RETRY);
+}
+
+/* Handle lines from the thread within the budget given by serv_read(),
+ * returning 1 if it ran out. Called when the notify pipe is readable. */
+int
+io_read(struct Server *server, int *lines, long long deadline) {
+	struct IOThread *io = server->io;
+	char *line, *reason;
+	int fd = server->rfd;
+	int closed, n;
+
+	io_drain(io->notify[0]);
+	closed = atomic_load(&io->closed);
+	if ((n = atomic_exchange(&io->dropped, 0)))
+		ui_error("%d line%s from %s exceeded length limits, discarded",
+				n, n == 1 ? "" : "s", server->name);
+
+	while ((line = io_peek(&io->in))) {
+		if (*lines <= 0 || event_now() >= deadline)
+			return 1;
+		io_pop(&io->in);
+		if (atomic_exchange(&io->blocked, 0))
+			io_signal(io->wake[1]);
+		handle(server, line);
+		pfree(&line);
+		(*lines)--;
+		if (server->rfd != fd) /* handle() disconnected */
+			return 0;
+	}
+
+	/* closed was read before emptying the queue, so nothing is lost */
+	if (closed) {
+		reason = io->error ? estrdup(io->error) : NULL;
+		serv_disconnect(server, 1, "EOF");
+		hist_format(server->history, Activity_error, HIST_SHOW,
+				"SELF_CONNECTLOST %s %s %s :%s",
+				server->name, server->host, server->port, reason ? reason : "connection closed");
+		pfree(&reason);
+	}
+	return 0;
+}
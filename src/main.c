@@ -27,7 +27,6 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <signal.h>
-#include <poll.h>
 #include "hirc.h"
 
 struct Server *servers = NULL;
@@ -68,6 +67,9 @@ cleanup(char *quitmsg) {
 	}
 
 	serv_free(prev);
+
+	/* give QUIT a chance to be sent */
+	while (serv_linger() && event_wait() != -1);
 	ui_deinit();
 }
 
@@ -75,8 +77,10 @@ int
 main(int argc, char *argv[]) {
 	struct Selected oldselected;
 	struct Server *sp;
-	int i, j, refreshed, inputrefreshed;
+	struct Batch *b;
+	int i, j, ret, refreshed, inputrefreshed;
 	long pinginact, reconnectinterval, maxreconnectinterval;
+	time_t now, deadline;
 
 	if (argc > 2) {
 		fprintf(stderr, "usage: %s [configfile]\n", basename(argv[0]));
@@ -113,36 +117,79 @@ main(int argc, char *argv[]) {
 	main_buf->unread = main_buf->ignored = 0;
 	main_buf->server = NULL;
 	main_buf->channel = NULL;
-	main_buf->history = NULL;
+	main_buf->history = main_buf->oldest = main_buf->placed = NULL;
+	main_buf->len = 0;
+	main_buf->seen = NULL;
 
+	signal(SIGPIPE, SIG_IGN);
+	event_init();
+	dns_init();
 	ui_init();
 
 	if (argc == 2)
 		if (config_read(argv[1]) == -1)
 			die(1, "cannot read config file '%s': %s\n", argv[1], strerror(errno));
 
-	for (;;) {
-		/* 25 seems fast enough not to cause any visual lag */
-		if (serv_poll(&servers, 25) < 0) {
-			perror("serv_poll()");
-			exit(EXIT_FAILURE);
-		}
+	/* draw the screen before waiting for anything */
+	event_timer(0);
 
+	for (;;) {
 		pinginact = config_getl("misc.pingtime");
 		reconnectinterval = config_getl("reconnect.interval");
 		maxreconnectinterval = config_getl("reconnect.maxinterval");
+
+		/* sleep until the checks below next need to be made */
+		for (now = time(NULL), sp = servers; sp; sp = sp->next) {
+			for (b = sp->batches; b; b = b->next)
+				if (b->expires)
+					event_timer((b->expires - now) * 1000);
+			if (sp->pingsent)
+				deadline = sp->pingsent + pinginact;
+			else if (sp->lastrecv)
+				deadline = sp->lastrecv + pinginact;
+			else if (sp->status == ConnStatus_notconnected && sp->reconnect)
+				deadline = sp->lastconnected + (sp->connectfail * reconnectinterval < maxreconnectinterval
+						? sp->connectfail * reconnectinterval : maxreconnectinterval);
+			else
+				continue;
+			event_timer((deadline - now) * 1000);
+		}
+
+		if ((ret = event_wait()) == -1) {
+			perror("event_wait()");
+			exit(EXIT_FAILURE);
+		}
+
+		if (ret & EVENT_RESIZE)
+			ui_resize();
+		if (ret & EVENT_DNS)
+			dns_read();
+		serv_linger();
+
+		/* before servers, so that a flood can't hold up typing */
+		if (ret & EVENT_INPUT)
+			ui_read();
+
 		for (sp = servers; sp; sp = sp->next) {
-			if (sp->rpollfd->revents) {
-				/* received an event */
-				sp->pingsent = 0;
-				sp->lastrecv = time(NULL);
-				sp->rpollfd->revents = 0;
-				serv_read(sp);
-			} else if (!sp->pingsent && sp->lastrecv && (time(NULL) - sp->lastrecv) >= pinginact) {
+			now = time(NULL);
+			serv_lag(sp);
+			serv_pace(sp);
+			if (sp->conn.len) {
+				/* connection attempts in progress */
+				sp->revents = 0;
+				serv_connect_poll(sp);
+			} else if (sp->revents || sp->input.more) {
+				/* received an event, or input left over */
+				if (sp->revents & EVENT_READ) {
+					sp->pingsent = 0;
+					sp->lastrecv = now;
+				}
+				serv_event(sp);
+			} else if (!sp->pingsent && sp->lastrecv && (now - sp->lastrecv) >= pinginact) {
 				/* haven't heard from server in pinginact seconds, sending a ping */
 				serv_write(sp, Sched_now, "PING :ground control to Major Tom\r\n");
-				sp->pingsent = time(NULL);
-			} else if (sp->pingsent && (time(NULL) - sp->pingsent) >= pinginact) {
+				sp->pingsent = now;
+			} else if (sp->pingsent && (now - sp->pingsent) >= pinginact) {
 				/* haven't gotten a response in pinginact seconds since
 				 * sending ping, this connexion is probably dead now */
 				serv_disconnect(sp, 1, NULL);
@@ -150,11 +197,17 @@ main(int argc, char *argv[]) {
 						"SELF_CONNECTLOST %s %s %s :No ping reply in %d seconds",
 						sp->name, sp->host, sp->port, pinginact);
 			} else if (sp->status == ConnStatus_notconnected && sp->reconnect &&
-					((time(NULL) - sp->lastconnected) >= maxreconnectinterval ||
-					(time(NULL) - sp->lastconnected) >= (sp->connectfail * reconnectinterval))) {
+					((now - sp->lastconnected) >= maxreconnectinterval ||
+					(now - sp->lastconnected) >= (sp->connectfail * reconnectinterval))) {
 				/* time since last connected is sufficient to initiate reconnect */
 				serv_connect(sp);
 			}
+
+			handle_batch_expire(sp);
+
+			/* after input: joins planned on connecting
+			 * may need what RPL_ISUPPORT says */
+			serv_join_send(sp);
 		}
 
 		if (oldselected.channel != selected.channel || oldselected.server != selected.server) {
@@ -198,8 +251,6 @@ main(int argc, char *argv[]) {
 		 * force ncurses to place the cursor here. */
 		if (refreshed && !inputrefreshed)
 			wrefresh(windows[Win_input].window);
-
-		ui_read();
 	}
 
 	return 0;
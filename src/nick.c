@@ -138,6 +138,8 @@ nick_create(char *prefix, char priv, struct Server *server) {
 	nick->prefix = estrdup(prefix);
 	nick->next = nick->prev = NULL;
 	nick->priv = priv;
+	nick->privs[0] = priv == ' ' ? '\0' : priv;
+	nick->privs[1] = '\0';
 	prefix_tokenize(nick->prefix, &nick->nick, &nick->ident, &nick->host);
 	nick->self = nick_isself_server(nick, server);
 
@@ -157,7 +159,7 @@ nick_isself_server(struct Nick *nick, struct Server *server) {
 	if (!nick || !server || !nick->nick)
 		return 0;
 
-	if (strcmp_n(server->self->nick, nick->nick) == 0)
+	if (serv_casecmp(server, server->self->nick, nick->nick) == 0)
 		return 1;
 	else
 		return 0;
@@ -189,6 +191,7 @@ nick_dup(struct Nick *nick) {
 	ret = emalloc(sizeof(struct Nick));
 	ret->prev = ret->next = NULL;
 	ret->priv   = nick->priv;
+	memcpy(ret->privs, nick->privs, sizeof(ret->privs));
 	ret->prefix = nick->prefix ? strdup(nick->prefix) : NULL;
 	ret->nick   = nick->nick ? strdup(nick->nick) : NULL;
 	ret->ident  = nick->ident ? strdup(nick->ident) : NULL;
@@ -198,12 +201,12 @@ nick_dup(struct Nick *nick) {
 }
 
 struct Nick *
-nick_get(struct Nick **head, char *nick) {
+nick_get(struct Nick **head, char *nick, struct Server *server) {
 	struct Nick *p;
 
 	p = *head;
 	for (; p; p = p->next) {
-		if (strcmp_n(p->nick, nick) == 0)
+		if (serv_casecmp(server, p->nick, nick) == 0)
 			return p;
 	}
 
@@ -211,15 +214,21 @@ nick_get(struct Nick **head, char *nick) {
 }
 
 int
-nick_remove(struct Nick **head, char *nick) {
+nick_remove(struct Nick **head, char *nick, struct Server *server) {
 	struct Nick *p;
 
 	if (!head || !nick)
 		return -1;
 
-	if ((p = nick_get(head, nick)) == NULL)
+	if ((p = nick_get(head, nick, server)) == NULL)
 		return 0;
 
+	nick_removep(head, p);
+	return 1;
+}
+
+void
+nick_removep(struct Nick **head, struct Nick *p) {
 	if (*head == p)
 		*head = p->next;
 	if (p->next)
@@ -227,12 +236,12 @@ nick_remove(struct Nick **head, char *nick) {
 	if (p->prev)
 		p->prev->next = p->next;
 	nick_free(p);
-	return 1;
 }
 
 static inline void
 nick_dcpy(struct Nick *dest, struct Nick *origin) {
 	dest->priv   = origin->priv;
+	memcpy(dest->privs, origin->privs, sizeof(dest->privs));
 	dest->prefix = origin->prefix;
 	dest->nick   = origin->nick;
 	dest->ident  = origin->ident;
@@ -297,3 +306,45 @@ nick_sort(struct Nick **head, struct Server *server) {
 		}
 	} while (swapped);
 }
+
+/* The prefixes in PREFIX=(ov)@+, highest first */
+static char *
+nick_prefixes(struct Server *server) {
+	return server ? server->isupport.prefixes : "";
+}
+
+/* Give nick the privilege shown by the prefix priv, or take it away.
+ * The others held are kept, so -o leaves the + of someone +ov. */
+void
+nick_setpriv(struct Nick *nick, struct Server *server, char priv, int set) {
+	char privs[sizeof(nick->privs)];
+	char *p;
+	size_t i;
+
+	assert_warn(nick,);
+
+	for (p = nick_prefixes(server), i = 0; *p && i < sizeof(privs) - 1; p++)
+		if (*p == priv ? set : strchr(nick->privs, *p) != NULL)
+			privs[i++] = *p;
+	privs[i] = '\0';
+
+	memcpy(nick->privs, privs, sizeof(privs));
+	nick->priv = *privs ? *privs : ' ';
+}
+
+/* Set all of nick's privileges, from the len prefixes before a nick in
+ * RPL_NAMREPLY. Without multi-prefix there is only the highest. */
+void
+nick_setprivs(struct Nick *nick, struct Server *server, char *privs, size_t len) {
+	char *p;
+	size_t i;
+
+	assert_warn(nick,);
+
+	for (p = nick_prefixes(server), i = 0; *p && i < sizeof(nick->privs) - 1; p++)
+		if (memchr(privs, *p, len))
+			nick->privs[i++] = *p;
+	nick->privs[i] = '\0';
+	nick->priv = i ? *nick->privs : ' ';
+}
+
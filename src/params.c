@@ -17,7 +17,9 @@
  *
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "hirc.h"
 
 void
@@ -37,6 +39,19 @@ param_len(char **params) {
 	return i;
 }
 
+char **
+param_dup(char **params) {
+	char **ret;
+	int i, len;
+
+	len = param_len(params);
+	ret = emalloc(sizeof(char *) * (len + 1));
+	for (i = 0; i < len; i++)
+		ret[i] = estrdup(params[i]);
+	ret[i] = NULL;
+	return ret;
+}
+
 char **
 param_create(char *msg) {
 	char **ret, **rp;
@@ -71,3 +86,118 @@ param_create(char *msg) {
 
 	return ret;
 }
+
+/*
+ * IRCv3 message tags: "@key=value;key;+client/key=a\sb :nick!u@h PRIVMSG ..."
+ *
+ * handle() keeps everything between '@' and the first space in
+ * History.tags. These functions give views into that string, so looking
+ * a tag up doesn't allocate. Values are only unescaped when asked for.
+ */
+
+/* Read the tag at *tags into tag and move past it.
+ * Returns 0 when there are none left. */
+int
+tag_next(char **tags, struct Tag *tag) {
+	char *p;
+	size_t len;
+
+	if (!tags || !*tags || !**tags)
+		return 0;
+
+	p = *tags;
+	len = strcspn(p, ";");
+	tag->key = p;
+	tag->keylen = strcspn(p, "=;");
+	if (tag->keylen < len) {
+		tag->value = p + tag->keylen + 1;
+		tag->len = len - tag->keylen - 1;
+	} else {
+		tag->value = NULL;
+		tag->len = 0;
+	}
+
+	*tags = p[len] ? p + len + 1 : p + len;
+	return 1;
+}
+
+/* Find key in tags. Returns 0 if it isn't there. */
+int
+tag_get(char *tags, char *key, struct Tag *tag) {
+	size_t len;
+
+	if (!tags || !key)
+		return 0;
+
+	len = strlen(key);
+	while (tag_next(&tags, tag))
+		if (tag->keylen == len && memcmp(tag->key, key, len) == 0)
+			return 1;
+	return 0;
+}
+
+/* Unescape tag's value into buf. An empty value and a missing one are
+ * the same thing, so both give "". */
+char *
+tag_value(struct Tag *tag, char *buf, size_t size) {
+	char *p, *end;
+	size_t i = 0;
+
+	assert_warn(tag && buf && size, NULL);
+
+	if (!tag->value) {
+		*buf = '\0';
+		return buf;
+	}
+
+	for (p = tag->value, end = p + tag->len; p < end && i < size - 1; p++) {
+		if (*p != '\\') {
+			buf[i++] = *p;
+			continue;
+		}
+		if (++p == end)
+			break;
+		switch (*p) {
+		case ':': buf[i++] = ';';  break;
+		case 's': buf[i++] = ' ';  break;
+		case 'r': buf[i++] = '\r'; break;
+		case 'n': buf[i++] = '\n'; break;
+		default:  buf[i++] = *p;   break;
+		}
+	}
+	buf[i] = '\0';
+	return buf;
+}
+
+/* Value of key in tags, unescaped into buf, or NULL if it isn't there */
+char *
+tag_gets(char *tags, char *key, char *buf, size_t size) {
+	struct Tag tag;
+
+	if (!tag_get(tags, key, &tag))
+		return NULL;
+	return tag_value(&tag, buf, size);
+}
+
+/* The server-time tag (YYYY-MM-DDThh:mm:ss.sssZ, always UTC) as a
+ * time_t, or 0 if it's missing or doesn't parse. Done by hand as
+ * timegm() isn't portable and mktime() would apply the local zone. */
+time_t
+tag_time(char *tags) {
+	char buf[64];
+	int y, mon, d, h, min, sec;
+	long days;
+
+	if (!tag_gets(tags, "time", buf, sizeof(buf)) ||
+			sscanf(buf, "%4d-%2d-%2dT%2d:%2d:%2d", &y, &mon, &d, &h, &min, &sec) != 6 ||
+			mon < 1 || mon > 12 || d < 1 || d > 31 || h > 23 || min > 59 || sec > 60)
+		return 0;
+
+	/* days since the epoch, counting years from March so the leap day is last */
+	if (mon <= 2) {
+		y--;
+		mon += 12;
+	}
+	days = 365L * y + y / 4 - y / 100 + y / 400 + (153 * (mon - 3) + 2) / 5 + d - 1 - 719468;
+	return (time_t)days * 86400 + h * 3600 + min * 60 + sec;
+}
@@ -21,19 +21,270 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #ifdef TLS
 #include <tls.h>
 #endif /* TLS */
 #include "hirc.h"
 
-/* 1024 is enough to fit two max-length messages in the buffer at once.
- * To stress-test this, it is possible to set it to 2 as the lowest value.
- * (The last byte is reserved for '\0', so a value of 1 will act weird). */
-#define INPUT_BUF_MIN 1024
+/* Longest lines sent: clients may send 4096 bytes of tags, like
+ * serv_request()'s label, on top of the 512 of RFC1459. */
+#define OUTPUT_TAGS_MAX 4096
+#define OUTPUT_LINE_MAX (OUTPUT_TAGS_MAX + 512)
+
+/* Most lines and milliseconds one server can take up at a time,
+ * see serv_read(). */
+#define INPUT_LINES 200
+#define INPUT_MSEC 10
+
+/* Max lines given to one writev(), and bytes to one tls_write()
+ * (the largest TLS record). */
+#define OUTPUT_IOV 64
+#define OUTPUT_TLS 16384
+
+/* Milliseconds to spend finishing off a connection after
+ * disconnecting, before it is closed regardless. */
+#define LINGER_TIME 5000
+
+static struct Linger *lingering = NULL;
+
+/* Commands that are sent ahead of, or behind, everything else.
+ * Anything not listed here is Prio_normal. */
+static struct {
+	char *cmd;
+	enum Priority prio;
+} priorities[] = {
+	{"PONG",	Prio_urgent},
+	{"PING",	Prio_urgent},
+	{"QUIT",	Prio_urgent},
+	{"PASS",	Prio_urgent},
+	{"NICK",	Prio_urgent},
+	{"USER",	Prio_urgent},
+	{"CAP",		Prio_urgent},
+	{"NAMES",	Prio_bulk},
+	{"WHO",		Prio_bulk},
+	{"WHOIS",	Prio_bulk},
+	{"WHOWAS",	Prio_bulk},
+	{"LIST",	Prio_bulk},
+	{"CHATHISTORY",	Prio_bulk},
+};
+
+static enum Priority
+serv_priority(char *msg) {
+	size_t len, i;
+
+	/* @label=... from serv_request() */
+	if (*msg == '@') {
+		msg += strcspn(msg, " ");
+		msg += strspn(msg, " ");
+	}
+
+	len = strcspn(msg, " \r\n");
+	for (i = 0; i < sizeof(priorities) / sizeof(*priorities); i++)
+		if (strlen(priorities[i].cmd) == len && strncmp(msg, priorities[i].cmd, len) == 0)
+			return priorities[i].prio;
+
+	/* MODE <target> without a modestring only asks for the modes */
+	if (len == CONSTLEN("MODE") && strncmp(msg, "MODE", len) == 0 && msg[len] == ' ' &&
+			strcspn(msg + len + 1, " \r\n") == strcspn(msg + len + 1, "\r\n"))
+		return Prio_bulk;
+
+	return Prio_normal;
+}
+
+/* Queue msg to be written by serv_flush(), returns its length.
+ * It waits in the queue for its priority until serv_pace() lets it go. */
+static int
+serv_output_add(struct Server *server, char *msg) {
+	struct Output *o;
+	enum Priority prio;
+
+	prio = serv_priority(msg);
+	o = emalloc(sizeof(struct Output));
+	o->len = strlen(msg);
+	o->msg = emalloc(o->len);
+	memcpy(o->msg, msg, o->len);
+	o->delayed = 0;
+	o->next = NULL;
+	o->prev = server->output.queue[prio].tail;
+	if (server->output.queue[prio].tail)
+		server->output.queue[prio].tail->next = o;
+	else
+		server->output.queue[prio].head = o;
+	server->output.queue[prio].tail = o;
+	server->output.queue[prio].lines++;
+	return o->len;
+}
+
+static void
+serv_output_pop(struct Server *server) {
+	struct Output *o = server->output.head;
+
+	server->output.head = o->next;
+	if (o->next)
+		o->next->prev = NULL;
+	else
+		server->output.tail = NULL;
+	server->output.len -= o->len - server->output.off;
+	server->output.lines--;
+	server->output.off = 0;
+	pfree(&o->msg);
+	pfree(&o);
+}
+
+/* Drop n bytes that have been written from the start of the queue */
+static void
+serv_output_consume(struct Server *server, size_t n) {
+	size_t left;
+
+	while (n && server->output.head) {
+		left = server->output.head->len - server->output.off;
+		if (n < left) {
+			server->output.off += n;
+			server->output.len -= n;
+			return;
+		}
+		n -= left;
+		serv_output_pop(server);
+	}
+}
+
+static void
+serv_output_clear(struct Server *server) {
+	struct Output *o, *next;
+	int i;
+
+	while (server->output.head)
+		serv_output_pop(server);
+	for (i = 0; i < Prio_last; i++) {
+		for (o = server->output.queue[i].head; o; o = next) {
+			next = o->next;
+			pfree(&o->msg);
+			pfree(&o);
+		}
+		server->output.queue[i].head = server->output.queue[i].tail = NULL;
+		server->output.queue[i].lines = 0;
+	}
+#ifdef TLS
+	server->output.tlslen = 0;
+#endif /* TLS */
+}
+
+#ifdef TLS
+/* Move as many whole lines as fit from the queue into output.tls,
+ * returns the number of bytes now there */
+static size_t
+serv_output_take(struct Server *server) {
+	struct Output *o;
+
+	if (!server->output.tls)
+		server->output.tls = emalloc(OUTPUT_TLS);
+	while ((o = server->output.head) && server->output.tlslen + o->len <= OUTPUT_TLS) {
+		memcpy(&server->output.tls[server->output.tlslen], o->msg, o->len);
+		server->output.tlslen += o->len;
+		serv_output_pop(server);
+	}
+	return server->output.tlslen;
+}
+#endif /* TLS */
+
+/* Wait for the socket to be readable, and writable if there is output
+ * waiting (or, with TLS, whatever libtls last asked for) */
+static void
+serv_rearm(struct Server *server) {
+	enum EventOpt want = EVENT_READ;
+
+#ifdef IOTHREAD
+	if (server->io) {
+		io_write(server);
+		return;
+	}
+#endif /* IOTHREAD */
+
+#ifdef TLS
+	if (server->tls) {
+		if (server->tls_pollout || (!server->tls_handshake && !server->tls_wpollin &&
+					(server->output.tlslen || server->output.head)))
+			want |= EVENT_WRITE;
+	} else
+#endif /* TLS */
+	if (server->output.head)
+		want |= EVENT_WRITE;
+
+	if (server->wfd != -1)
+		event_mod(server->wfd, want);
+}
+
+/*
+ * Flood control: move lines from the priority queues to the write queue.
+ *
+ * This is a token bucket holding flood.burst lines, refilled at one line
+ * every flood.interval milliseconds. It is kept as the time at which the
+ * bucket would be full again (output.flood): each line pushes this back by
+ * flood.interval, and a line may only go once it is less than a full
+ * bucket away. Prio_urgent lines always go, but still take a token.
+ */
+void
+serv_pace(struct Server *server) {
+	struct Output *o;
+	long long now, burst, interval, wait;
+	int prio, moved = 0;
+
+	assert_warn(server,);
+
+	now = event_now();
+	burst = config_getl("flood.burst");
+	interval = config_getl("flood.interval");
+	if (server->output.flood < now)
+		server->output.flood = now;
+
+	for (prio = 0; prio < Prio_last; prio++) {
+		while ((o = server->output.queue[prio].head)) {
+			wait = server->output.flood - now - (burst - 1) * interval;
+			if (prio != Prio_urgent && burst && wait > 0) {
+				if (!o->delayed) {
+					o->delayed = 1;
+					server->output.delayed++;
+				}
+				event_timer(wait);
+				goto end;
+			}
+
+			server->output.queue[prio].head = o->next;
+			if (o->next)
+				o->next->prev = NULL;
+			else
+				server->output.queue[prio].tail = NULL;
+			server->output.queue[prio].lines--;
+
+			o->next = NULL;
+			o->prev = server->output.tail;
+			if (server->output.tail)
+				server->output.tail->next = o;
+			else
+				server->output.head = o;
+			server->output.tail = o;
+			server->output.len += o->len;
+			server->output.lines++;
+			server->output.sent++;
+			server->output.flood += interval;
+			moved = 1;
+		}
+	}
+
+end:
+	/* lines may also be left over from a full io_write() */
+	if (moved || server->output.head)
+		serv_rearm(server);
+}
 
 void
 serv_free(struct Server *server) {
@@ -49,7 +300,17 @@ serv_free(struct Server *server) {
 	pfree(&server->password);
 	pfree(&server->host);
 	pfree(&server->port);
-	pfree(&server->rpollfd);
+#ifdef IOTHREAD
+	io_stop(server);
+#endif /* IOTHREAD */
+	pfree(&server->input.buf);
+	serv_output_clear(server);
+	serv_join_clear(server, 1);
+	serv_batch_clear(server);
+	expect_clear(server);
+#ifdef TLS
+	pfree(&server->output.tls);
+#endif /* TLS */
 	nick_free(server->self);
 	hist_free_list(server->history);
 	chan_free_list(&server->channels);
@@ -79,6 +340,8 @@ serv_free(struct Server *server) {
 	if (server->tls)
 		if (server->tls_ctx)
 			tls_free(server->tls_ctx);
+	if (server->tls_session != -1)
+		close(server->tls_session);
 #endif /* TLS */
 	pfree(&server);
 }
@@ -94,13 +357,29 @@ serv_create(char *name, char *host, char *port, char *nick, char *username,
 	server = emalloc(sizeof(struct Server));
 	server->prev = server->next = NULL;
 	server->wfd = server->rfd = -1;
-	server->input.size = INPUT_BUF_MIN;
-	server->input.pos = 0;
-	server->input.buf = emalloc(server->input.size);
-	server->rpollfd = emalloc(sizeof(struct pollfd));
-	server->rpollfd->fd = -1;
-	server->rpollfd->events = POLLIN;
-	server->rpollfd->revents = 0;
+	server->input.buf = NULL;
+	serv_input_reset(&server->input);
+#ifdef IOTHREAD
+	server->io = NULL;
+#endif /* IOTHREAD */
+	server->output.head = server->output.tail = NULL;
+	server->output.off = server->output.len = 0;
+	server->output.lines = 0;
+	for (i = 0; i < Prio_last; i++) {
+		server->output.queue[i].head = server->output.queue[i].tail = NULL;
+		server->output.queue[i].lines = 0;
+	}
+	server->output.flood = 0;
+	server->output.sent = server->output.delayed = 0;
+#ifdef TLS
+	server->output.tls = NULL;
+	server->output.tlslen = 0;
+#endif /* TLS */
+	server->conn.dns = NULL;
+	server->conn.addrs = NULL;
+	server->conn.fds = NULL;
+	server->conn.len = server->conn.next = 0;
+	server->revents = 0;
 	server->status = ConnStatus_notconnected;
 	server->name = estrdup(name);
 	server->username = username ? estrdup(username) : NULL;
@@ -109,6 +388,7 @@ serv_create(char *name, char *host, char *port, char *nick, char *username,
 	server->host = estrdup(host);
 	server->port = estrdup(port);
 	server->supports = NULL;
+	support_reset(server);
 	server->self = nick_create(nick, ' ', NULL);
 	server->self->self = 1;
 	server->history = emalloc(sizeof(struct HistInfo));
@@ -116,21 +396,34 @@ serv_create(char *name, char *host, char *port, char *nick, char *username,
 	server->history->unread = server->history->ignored = 0;
 	server->history->server = server;
 	server->history->channel = NULL;
-	server->history->history = NULL;
+	server->history->history = server->history->oldest = server->history->placed = NULL;
+	server->history->len = 0;
+	server->history->seen = NULL;
 	server->channels = NULL;
 	server->queries = NULL;
 	server->schedule = NULL;
+	server->joins = NULL;
+	server->batches = NULL;
+	server->labels = NULL;
+	server->labelid = 0;
+	server->capneg = server->capreq = server->caps = 0;
 	server->reconnect = 0;
 	for (i=0; i < Expect_last; i++)
 		server->expect[i] = NULL;
 	server->autocmds = NULL;
 	server->connectfail = 0;
 	server->lastconnected = server->lastrecv = server->pingsent = 0;
+	server->connected = 0;
+	memset(&server->lag, 0, sizeof(server->lag));
+	server->lag.last = -1;
 
 #ifdef TLS
 	server->tls_verify = tls_verify;
 	server->tls = tls;
 	server->tls_ctx = NULL;
+	server->tls_handshake = server->tls_pollout = server->tls_wpollin = 0;
+	server->tls_session = -1;
+	server->tls_resumed = server->tls_full = 0;
 #else
 	if (tls)
 		hist_format(server->history, Activity_error, HIST_SHOW,
@@ -229,55 +522,179 @@ serv_remove(struct Server **head, char *name) {
 	return 1;
 }
 
-void
-serv_connect(struct Server *server) {
-	struct tls_config *tls_conf;
-	struct Support *s, *prev;
-	struct addrinfo hints;
-	struct addrinfo *ai = NULL;
-	int fd, ret;
+/* Close any connection attempts, except for addrs[keep] */
+static void
+serv_connect_abort(struct Server *server, int keep) {
+	int i;
 
-	assert_warn(server,);
+	for (i = 0; i < server->conn.len; i++) {
+		if (i != keep && server->conn.fds[i] != -1) {
+			event_del(server->conn.fds[i]);
+			close(server->conn.fds[i]);
+		}
+	}
+	dns_release(server->conn.dns);
+	pfree(&server->conn.addrs);
+	pfree(&server->conn.fds);
+	server->conn.dns = NULL;
+	server->conn.len = server->conn.next = 0;
+}
 
-	if (server->status != ConnStatus_notconnected) {
-		ui_error("server '%s' is already connected", server->name);
-		return;
+static void
+serv_connect_fail(struct Server *server) {
+	serv_disconnect(server, 1, NULL);
+	if (server->connectfail * config_getl("reconnect.interval") < config_getl("reconnect.maxinterval"))
+		server->connectfail += 1;
+}
+
+/* Sort addresses as in RFC 8305, section 4: alternate between address
+ * families, starting with the one getaddrinfo() put first. */
+static void
+serv_connect_order(struct Server *server) {
+	struct addrinfo *p, *a, *b;
+	int family, i, len;
+
+	for (len = 0, p = server->conn.dns->ai; p; p = p->ai_next)
+		len++;
+
+	server->conn.addrs = emalloc(len * sizeof(struct addrinfo *));
+	server->conn.fds = emalloc(len * sizeof(int));
+	server->conn.len = len;
+	server->conn.next = 0;
+	server->conn.error = 0;
+
+	family = server->conn.dns->ai->ai_family;
+	for (i = 0, a = b = server->conn.dns->ai; i < len; ) {
+		for (; a && a->ai_family != family; a = a->ai_next);
+		if (a) {
+			server->conn.addrs[i++] = a;
+			a = a->ai_next;
+		}
+		for (; b && b->ai_family == family; b = b->ai_next);
+		if (b) {
+			server->conn.addrs[i++] = b;
+			b = b->ai_next;
+		}
 	}
 
-	for (s = server->supports, prev = NULL; s; s = s->next) {
-		if (prev) {
-			pfree(&prev->key);
-			pfree(&prev->value);
-			pfree(&prev);
+	for (i = 0; i < len; i++)
+		server->conn.fds[i] = -1;
+}
+
+#ifdef TLS
+/* Open the file libtls resumes a session from and saves the new one to.
+ * With tls.session.dir it is kept per server and survives a restart,
+ * otherwise an unlinked temporary file keeps it for as long as hirc runs. */
+static int
+serv_session(struct Server *server) {
+	char path[PATH_MAX];
+	struct stat st;
+	char *dir;
+	int fd;
+
+	if (!config_getl("tls.session"))
+		return -1;
+
+	if ((dir = config_gets("tls.session.dir")) != NULL) {
+		dir = homepath(dir);
+		if (stat(dir, &st) == -1 && mkdir(dir, 0700) == -1) {
+			ui_error("Could not create dir '%s': %s", dir, strerror(errno));
+			return -1;
+		}
+		snprintf(path, sizeof(path), "%s/%s.session", dir, server->name);
+		fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	} else {
+		if (server->tls_session != -1)
+			return server->tls_session;
+		dir = getenv("TMPDIR");
+		snprintf(path, sizeof(path), "%s/hirc-session.XXXXXX", dir ? dir : "/tmp");
+		if ((fd = mkstemp(path)) != -1) {
+			unlink(path);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
 		}
-		prev = s;
 	}
-	server->supports = NULL;
-	support_set(server, "CHANTYPES", config_gets("def.chantypes"));
-	support_set(server, "PREFIX", config_gets("def.prefixes"));
 
-	server->status = ConnStatus_connecting;
-	hist_format(server->history, Activity_status, HIST_SHOW|HIST_MAIN,
-			"SELF_CONNECTING %s %s", server->host, server->port);
+	if (fd == -1) {
+		ui_error("Could not open '%s': %s", path, strerror(errno));
+		return -1;
+	}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	/* libtls won't use a file that others can read */
+	fchmod(fd, 0600);
+	if (server->tls_session != -1)
+		close(server->tls_session);
+	return server->tls_session = fd;
+}
 
-	if ((ret = getaddrinfo(server->host, server->port, &hints, &ai)) != 0 || ai == NULL) {
+/* Continue the TLS handshake.
+ * Returns 1 while it is in progress, 0 once done and -1 if it failed. */
+static int
+serv_handshake(struct Server *server) {
+	switch (tls_handshake(server->tls_ctx)) {
+	case TLS_WANT_POLLOUT:
+		server->tls_pollout = 1;
+		/* fallthrough */
+	case TLS_WANT_POLLIN:
+		return 1;
+	case -1:
 		hist_format(server->history, Activity_error, HIST_SHOW,
-				"SELF_LOOKUPFAIL %s %s %s :%s",
-				server->name, server->host, server->port, gai_strerror(ret));
-		goto fail;
+				"SELF_CONNECTLOST %s %s %s :%s",
+				server->name, server->host, server->port, tls_error(server->tls_ctx));
+		serv_connect_fail(server);
+		return -1;
 	}
-	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 || connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
-		hist_format(server->history, Activity_error, HIST_SHOW,
-				"SELF_CONNECTFAIL %s %s %s :%s",
-				server->name, server->host, server->port, strerror(errno));
-		goto fail;
+
+	server->tls_handshake = 0;
+	server->connectfail = 0;
+	if (tls_conn_session_resumed(server->tls_ctx))
+		server->tls_resumed++;
+	else
+		server->tls_full++;
+	if (tls_peer_cert_provided(server->tls_ctx)) {
+		hist_format(server->history, Activity_status, HIST_SHOW,
+				"SELF_TLS_VERSION %s %s %d %s",
+				server->name, tls_conn_version(server->tls_ctx),
+				tls_conn_cipher_strength(server->tls_ctx),
+				tls_conn_cipher(server->tls_ctx));
+		if (server->tls_session != -1)
+			hist_format(server->history, Activity_status, HIST_SHOW,
+					"SELF_TLS_SESSION %s %s %lu %lu", server->name,
+					tls_conn_session_resumed(server->tls_ctx) ? "resumed" : "new",
+					server->tls_resumed, server->tls_full);
+		hist_format(server->history, Activity_status, HIST_SHOW, "SELF_TLS_SNI %s :%s",
+				server->name, tls_conn_servername(server->tls_ctx));
+		hist_format(server->history, Activity_status, HIST_SHOW, "SELF_TLS_ISSUER %s :%s",
+				server->name, tls_peer_cert_issuer(server->tls_ctx));
+		hist_format(server->history, Activity_status, HIST_SHOW, "SELF_TLS_SUBJECT %s :%s",
+				server->name, tls_peer_cert_subject(server->tls_ctx));
 	}
+#ifdef IOTHREAD
+	io_start(server);
+#endif /* IOTHREAD */
+	return 0;
+}
+#endif /* TLS */
+
+/* The attempt on addrs[i] connected: drop the others and register */
+static void
+serv_connected(struct Server *server, int i) {
+#ifdef TLS
+	struct tls_config *tls_conf = NULL;
+	int sfd;
+#endif /* TLS */
+	int fd;
+
+	fd = server->conn.fds[i];
+	serv_connect_abort(server, i);
 
 	server->rfd = server->wfd = fd;
+	server->lastrecv = time(NULL); /* time out if nothing is ever received */
+
+	/* connect() can succeed at once, before fd was ever watched */
+	if (event_add(fd, EVENT_READ, server) == -1) {
+		serv_connect_fail(server);
+		return;
+	}
 	hist_format(server->history, Activity_status, HIST_SHOW|HIST_MAIN,
 			"SELF_CONNECTED %s %s %s", server->name, server->host, server->port);
 
@@ -286,6 +703,7 @@ serv_connect(struct Server *server) {
 		if (server->tls_ctx)
 			tls_free(server->tls_ctx);
 		server->tls_ctx = NULL;
+		server->tls_pollout = server->tls_wpollin = 0;
 
 		if ((tls_conf = tls_config_new()) == NULL) {
 			ui_tls_config_error(tls_conf, "tls_config_new()");
@@ -297,6 +715,12 @@ serv_connect(struct Server *server) {
 			tls_config_insecure_noverifyname(tls_conf);
 		}
 
+		/* Not being able to resume isn't fatal: it just costs
+		 * a full handshake */
+		if ((sfd = serv_session(server)) != -1 &&
+				tls_config_set_session_fd(tls_conf, sfd) == -1)
+			ui_tls_config_error(tls_conf, "tls_config_set_session_fd()");
+
 		if ((server->tls_ctx = tls_client()) == NULL) {
 			ui_perror("tls_client()");
 			goto fail;
@@ -306,6 +730,8 @@ serv_connect(struct Server *server) {
 			ui_tls_error(server->tls_ctx, "tls_configure()");
 			goto fail;
 		}
+		tls_config_free(tls_conf);
+		tls_conf = NULL;
 
 		if (tls_connect_socket(server->tls_ctx, fd, server->host) == -1) {
 			hist_format(server->history, Activity_error, HIST_SHOW,
@@ -314,34 +740,27 @@ serv_connect(struct Server *server) {
 			goto fail;
 		}
 
-		if (tls_handshake(server->tls_ctx) == -1) {
-			hist_format(server->history, Activity_error, HIST_SHOW,
-					"SELF_CONNECTLOST %s %s %s :%s",
-					server->name, server->host, server->port, tls_error(server->tls_ctx));
-			goto fail;
-		}
-
-		tls_config_free(tls_conf);
-
-		if (tls_peer_cert_provided(server->tls_ctx)) {
-			hist_format(server->history, Activity_status, HIST_SHOW,
-					"SELF_TLS_VERSION %s %s %d %s",
-					server->name, tls_conn_version(server->tls_ctx),
-					tls_conn_cipher_strength(server->tls_ctx),
-					tls_conn_cipher(server->tls_ctx));
-			hist_format(server->history, Activity_status, HIST_SHOW, "SELF_TLS_SNI %s :%s",
-					server->name, tls_conn_servername(server->tls_ctx));
-			hist_format(server->history, Activity_status, HIST_SHOW, "SELF_TLS_ISSUER %s :%s",
-					server->name, tls_peer_cert_issuer(server->tls_ctx));
-			hist_format(server->history, Activity_status, HIST_SHOW, "SELF_TLS_SUBJECT %s :%s",
-					server->name, tls_peer_cert_subject(server->tls_ctx));
-		}
+		/* The socket stays non-blocking, the handshake
+		 * is continued by serv_event() as it becomes ready.
+		 * Anything written until then is buffered. */
+		server->tls_handshake = 1;
+		if (serv_handshake(server) == -1)
+			return;
+		serv_rearm(server);
+	} else {
+#endif /* TLS */
+		server->connectfail = 0;
+#ifdef IOTHREAD
+		io_start(server);
+#endif /* IOTHREAD */
+#ifdef TLS
 	}
 #endif /* TLS */
 
-	freeaddrinfo(ai);
-	server->connectfail = 0;
-
+	/* The server holds off registering until CAP END,
+	 * one that doesn't know CAP just ignores it */
+	serv_write(server, Sched_now, "CAP LS 302\r\n");
+	server->capneg = 1;
 	if (server->password)
 		serv_write(server, Sched_now, "PASS %s\r\n", server->password);
 	serv_write(server, Sched_now, "NICK %s\r\n", server->self->nick);
@@ -351,96 +770,387 @@ serv_connect(struct Server *server) {
 
 	return;
 
+#ifdef TLS
 fail:
-	serv_disconnect(server, 1, NULL);
-	if (server->connectfail * config_getl("reconnect.interval") < config_getl("reconnect.maxinterval"))
-		server->connectfail += 1;
-	if (ai)
-		freeaddrinfo(ai);
+	if (tls_conf)
+		tls_config_free(tls_conf);
+	serv_connect_fail(server);
+#endif /* TLS */
+}
+
+/* Start attempts until one is in progress, or there is nothing left */
+static void
+serv_connect_next(struct Server *server) {
+	struct addrinfo *ai;
+	int fd, i;
+
+	while ((i = server->conn.next) < server->conn.len) {
+		ai = server->conn.addrs[i];
+		server->conn.next++;
+		server->conn.last = event_now();
+
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 ||
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+			server->conn.error = errno;
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+
+		server->conn.fds[i] = fd;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			serv_connected(server, i);
+			return;
+		} else if (errno == EINPROGRESS && event_add(fd, EVENT_WRITE, server) != -1) {
+			event_timer(config_getl("connect.delay"));
+			return;
+		}
+
+		server->conn.error = errno;
+		server->conn.fds[i] = -1;
+		close(fd);
+	}
+
+	for (i = 0; i < server->conn.len; i++)
+		if (server->conn.fds[i] != -1)
+			return;
+
+	/* the host may have moved, don't reuse these addresses */
+	dns_expire(server->conn.dns);
+	hist_format(server->history, Activity_error, HIST_SHOW,
+			"SELF_CONNECTFAIL %s %s %s :%s",
+			server->name, server->host, server->port, strerror(server->conn.error));
+	serv_connect_fail(server);
+}
+
+/* Check on connection attempts, called from the main loop while connecting */
+void
+serv_connect_poll(struct Server *server) {
+	struct pollfd pfd;
+	socklen_t len;
+	long long wait;
+	int i, err, fd;
+
+	assert_warn(server,);
+
+	for (i = 0; i < server->conn.next; i++) {
+		if ((fd = server->conn.fds[i]) == -1)
+			continue;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) < 1)
+			continue;
+
+		len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+			err = errno;
+		if (err == 0) {
+			serv_connected(server, i);
+			return;
+		}
+
+		server->conn.error = err;
+		server->conn.fds[i] = -1;
+		event_del(fd);
+		close(fd);
+	}
+
+	for (i = 0; i < server->conn.next; i++)
+		if (server->conn.fds[i] != -1)
+			break;
+
+	/* Start the next attempt if nothing is in progress
+	 * or the last attempt has had connect.delay to finish */
+	wait = server->conn.last + config_getl("connect.delay") - event_now();
+	if (i == server->conn.next || wait <= 0)
+		serv_connect_next(server);
+	else if (server->conn.next < server->conn.len)
+		event_timer(wait);
+}
+
+/* Called by dns_lookup() or dns_read() with the result of a lookup */
+void
+serv_resolved(struct Server *server, struct DNSCache *dns, int ret) {
+	assert_warn(server,);
+
+	if (!dns) {
+		hist_format(server->history, Activity_error, HIST_SHOW,
+				"SELF_LOOKUPFAIL %s %s %s :%s",
+				server->name, server->host, server->port, gai_strerror(ret));
+		serv_connect_fail(server);
+		return;
+	}
+
+	server->conn.dns = dns;
+	serv_connect_order(server);
+	serv_connect_next(server);
+}
+
+void
+serv_connect(struct Server *server) {
+	assert_warn(server,);
+
+	if (server->status != ConnStatus_notconnected) {
+		ui_error("server '%s' is already connected", server->name);
+		return;
+	}
+
+	support_reset(server);
+
+	server->status = ConnStatus_connecting;
+	hist_format(server->history, Activity_status, HIST_SHOW|HIST_MAIN,
+			"SELF_CONNECTING %s %s", server->host, server->port);
+
+	dns_lookup(server);
+}
+
+/* Handle lines in the ring until it runs out or the budget given by
+ * serv_read() does, returning 1 in the latter case. */
+static int
+serv_input(struct Server *sp, int fd, int *lines, long long deadline) {
+	char *line;
+	int ret;
+
+	for (;;) {
+		if (*lines <= 0 || event_now() >= deadline)
+			return sp->input.scan < sp->input.len;
+		if ((ret = serv_input_line(&sp->input, &line)) == 0)
+			return 0;
+		if (ret == -1) {
+			ui_error("line from %s exceeds length limits, discarding", sp->name);
+			continue;
+		}
+		handle(sp, line);
+		(*lines)--;
+		if (sp->rfd != fd) /* handle() disconnected */
+			return 0;
+	}
 }
 
+/*
+ * Read and handle input from the server, until there is nothing more to
+ * read or the server has used up its budget of INPUT_LINES lines or
+ * INPUT_MSEC milliseconds. In the latter case, the rest is left for
+ * the next time round the main loop, so that other servers and the user
+ * get a look in during a flood. See input.more.
+ */
 void
 serv_read(struct Server *sp) {
-	char *line, *end;
+	struct iovec iov[2];
 	char *err;
 	char *reason = NULL;
 	size_t len;
-	int ret;
+	ssize_t ret;
+	long long deadline;
+	int fd, lines, iovcnt;
 
 	assert_warn(sp,);
 
+	fd = sp->rfd;
+	lines = INPUT_LINES;
+	deadline = event_now() + INPUT_MSEC;
+	sp->input.more = 0;
+
+#ifdef IOTHREAD
+	if (sp->io) {
+		if (io_read(sp, &lines, deadline))
+			goto more;
+		return;
+	}
+#endif /* IOTHREAD */
+
+	/* lines left over from last time */
+	if (serv_input(sp, fd, &lines, deadline))
+		goto more;
+
+	while (sp->rfd == fd) {
+		iovcnt = serv_input_space(&sp->input, iov);
+
 #ifdef TLS
-	if (sp->tls) {
-		switch (ret = tls_read(sp->tls_ctx, &sp->input.buf[sp->input.pos], sp->input.size - sp->input.pos - 1)) {
-		case -1:
-			err = (char *)tls_error(sp->tls_ctx);
-			len = CONSTLEN("tls_read(): ") + strlen(err) + 1;
-			reason = smprintf(len, "tls_read(): %s", err);
-			/* fallthrough */
-		case 0:
-			serv_disconnect(sp, 1, "EOF");
-			hist_format(sp->history, Activity_error, HIST_SHOW,
-					"SELF_CONNECTLOST %s %s %s :%s",
-					sp->name, sp->host, sp->port, reason ? reason : "connection closed");
-			pfree(&reason);
-			return;
-		case TLS_WANT_POLLIN:
-		case TLS_WANT_POLLOUT:
-			return;
-		default:
-			sp->input.pos += ret;
-			break;
-		}
-	} else {
+		/* libtls may have already read data from the socket that we
+		 * haven't seen, so it must be read until TLS_WANT_POLLIN:
+		 * waiting for the socket to become readable could take forever. */
+		if (sp->tls) {
+			switch (ret = tls_read(sp->tls_ctx, iov[0].iov_base, iov[0].iov_len)) {
+			case -1:
+				err = (char *)tls_error(sp->tls_ctx);
+				len = CONSTLEN("tls_read(): ") + strlen(err) + 1;
+				reason = smprintf(len, "tls_read(): %s", err);
+				/* fallthrough */
+			case 0:
+				serv_disconnect(sp, 1, "EOF");
+				hist_format(sp->history, Activity_error, HIST_SHOW,
+						"SELF_CONNECTLOST %s %s %s :%s",
+						sp->name, sp->host, sp->port, reason ? reason : "connection closed");
+				pfree(&reason);
+				return;
+			case TLS_WANT_POLLOUT:
+				sp->tls_pollout = 1;
+				/* fallthrough */
+			case TLS_WANT_POLLIN:
+				return;
+			default:
+				sp->input.len += ret;
+				break;
+			}
+		} else {
 #endif /* TLS */
-		switch (ret = read(sp->rfd, &sp->input.buf[sp->input.pos], sp->input.size - sp->input.pos - 1)) {
-		case -1:
-			err = estrdup(strerror(errno));
-			len = CONSTLEN("read(): ") + strlen(err) + 1;
-			reason = smprintf(len, "read(): %s", err);
-			pfree(&err);
-			/* fallthrough */
-		case 0:
-			serv_disconnect(sp, 1, "EOF");
-			hist_format(sp->history, Activity_error, HIST_SHOW,
-					"SELF_CONNECTLOST %s %s %s :%s",
-					sp->name, sp->host, sp->port, reason ? reason : "connection closed");
-			pfree(&reason);
-			return;
-		default:
-			sp->input.pos += ret;
-			break;
+			switch (ret = readv(sp->rfd, iov, iovcnt)) {
+			case -1:
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+					return;
+				err = estrdup(strerror(errno));
+				len = CONSTLEN("read(): ") + strlen(err) + 1;
+				reason = smprintf(len, "read(): %s", err);
+				pfree(&err);
+				/* fallthrough */
+			case 0:
+				serv_disconnect(sp, 1, "EOF");
+				hist_format(sp->history, Activity_error, HIST_SHOW,
+						"SELF_CONNECTLOST %s %s %s :%s",
+						sp->name, sp->host, sp->port, reason ? reason : "connection closed");
+				pfree(&reason);
+				return;
+			default:
+				sp->input.len += ret;
+				break;
+			}
+#ifdef TLS
 		}
+#endif /* TLS */
+
+		if (serv_input(sp, fd, &lines, deadline))
+			goto more;
+	}
+	return;
+
+more:
+	sp->input.more = 1;
+	event_timer(0);
+}
+
+/* Write out as much queued output as the connection will take */
+int
+serv_flush(struct Server *server) {
+	struct iovec iov[OUTPUT_IOV];
+	struct Output *p;
+	ssize_t ret;
+	int n;
+
+	if (server->wfd == -1)
+		return 0;
+
+#ifdef IOTHREAD
+	if (server->io) {
+		io_write(server);
+		return 0;
+	}
+#endif /* IOTHREAD */
+
 #ifdef TLS
+	if (server->tls) {
+		if (server->tls_handshake)
+			return 0;
+
+		/* After TLS_WANT_*, tls_write() must be retried with the same
+		 * data, so lines are only taken from the queue once the last
+		 * chunk has been written in full. */
+		while (server->output.tlslen || serv_output_take(server)) {
+			ret = tls_write(server->tls_ctx, server->output.tls, server->output.tlslen);
+			if (ret == TLS_WANT_POLLOUT) {
+				server->tls_pollout = 1;
+				break;
+			} else if (ret == TLS_WANT_POLLIN) {
+				server->tls_wpollin = 1;
+				break;
+			} else if (ret == -1) {
+				hist_format(server->history, Activity_error, HIST_SHOW,
+						"SELF_CONNECTLOST %s %s %s :%s",
+						server->name, server->host, server->port, tls_error(server->tls_ctx));
+				serv_disconnect(server, 1, NULL);
+				return -1;
+			}
+			server->output.tlslen -= ret;
+			memmove(server->output.tls, &server->output.tls[ret], server->output.tlslen);
+		}
+		serv_rearm(server);
+		return 0;
 	}
 #endif /* TLS */
 
-	sp->input.buf[sp->input.size - 1] = '\0';
-	line = sp->input.buf;
-	while ((end = strstr(line, "\r\n"))) {
-		*end = '\0';
-		handle(sp, line);
-		line = end + 2;
+	while (server->output.head) {
+		for (n = 0, p = server->output.head; p && n < OUTPUT_IOV; p = p->next, n++) {
+			iov[n].iov_base = p->msg;
+			iov[n].iov_len = p->len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + server->output.off;
+		iov[0].iov_len -= server->output.off;
+
+		if ((ret = writev(server->wfd, iov, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			hist_format(server->history, Activity_error, HIST_SHOW,
+					"SELF_CONNECTLOST %s %s %s :%s",
+					server->name, server->host, server->port, strerror(errno));
+			serv_disconnect(server, 1, NULL);
+			return -1;
+		}
+		serv_output_consume(server, ret);
 	}
+	serv_rearm(server);
+	return 0;
+}
+
+/* Handle events set in sp->revents by event_wait() */
+void
+serv_event(struct Server *sp) {
+	int revents;
+
+	assert_warn(sp,);
 
-	sp->input.pos -= line - sp->input.buf;
-	memmove(sp->input.buf, line, sp->input.pos);
+	revents = sp->revents;
+	sp->revents = 0;
 
-	/* Shrink and grow buffer as needed
-	 * If we didn't read everything, serv_read will be called
-	 * again in the main loop as poll gives another POLLIN. */
-	if (sp->input.pos + ret > sp->input.size / 2) {
-		sp->input.size *= 2;
-		sp->input.buf = erealloc(sp->input.buf, sp->input.size);
-	} else if (sp->input.pos + ret < sp->input.size / 2 && sp->input.size != INPUT_BUF_MIN) {
-		sp->input.size /= 2;
-		sp->input.buf = erealloc(sp->input.buf, sp->input.size);
+#ifdef IOTHREAD
+	/* the thread's notify pipe */
+	if (sp->io) {
+		serv_read(sp);
+		return;
+	}
+#endif /* IOTHREAD */
+
+#ifdef TLS
+	if (sp->tls) {
+		/* libtls may need to read in order to write, or the reverse,
+		 * so retry anything that could be waiting on either */
+		sp->tls_pollout = sp->tls_wpollin = 0;
+		if (sp->tls_handshake && serv_handshake(sp) != 0)
+			goto rearm;
+#ifdef IOTHREAD
+		if (sp->io)
+			return;
+#endif /* IOTHREAD */
+		if (serv_flush(sp) == -1)
+			return;
+		serv_read(sp);
+rearm:
+		if (sp->status != ConnStatus_notconnected)
+			serv_rearm(sp);
+		return;
 	}
+#endif /* TLS */
+
+	if (revents & EVENT_WRITE && serv_flush(sp) == -1)
+		return;
+	if (revents & EVENT_READ || sp->input.more)
+		serv_read(sp);
 }
 
 int
 serv_write(struct Server *server, enum Sched when, char *format, ...) {
-	char msg[512];
+	char msg[OUTPUT_LINE_MAX + 1];
 	va_list ap;
 	int ret;
 
@@ -450,7 +1160,8 @@ serv_write(struct Server *server, enum Sched when, char *format, ...) {
 	ret = vsnprintf(msg, sizeof(msg), format, ap);
 	va_end(ap);
 
-	assert_warn(ret >= 0, -1);
+	/* cut short, it would lose its "\r\n" and run into the next line */
+	assert_warn(ret >= 0 && (size_t)ret < sizeof(msg), -1);
 
 	if (when != Sched_now) {
 		switch (when) {
@@ -464,26 +1175,54 @@ serv_write(struct Server *server, enum Sched when, char *format, ...) {
 	}
 
 write:
+	if (server->wfd == -1)
+		return -1;
+
+	/* Only queue the message: it will be written once the event loop
+	 * sees that the socket is writable, along with anything else
+	 * written before then. */
+	ret = serv_output_add(server, msg);
+	serv_pace(server);
+	return ret;
+}
 
-#ifdef TLS
-	if (server->tls)
-		do {
-			ret = tls_write(server->tls_ctx, msg, strlen(msg));
-		} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
-	else
-#endif /* TLS */
-		ret = write(server->wfd, msg, strlen(msg));
-
-	if (ret == -1 && server->status == ConnStatus_connected) {
-		serv_disconnect(server, 1, NULL);
-		hist_format(server->history, Activity_error, HIST_SHOW,
-				"SELF_CONNECTLOST %s %s %s :%s",
-				server->name, server->host, server->port, strerror(errno));
-	} else if (ret == -1 && server->status != ConnStatus_connecting) {
-		ui_error("Not connected to server '%s'", server->name);
-	}
+/*
+ * Send text to target with cmd (PRIVMSG or NOTICE), as a CTCP ACTION if
+ * action is set. It is split over as many lines as it takes for each to
+ * reach others whole, once the server puts our prefix in front; these
+ * are paced like any other. Each line is echoed to chan as it was sent.
+ */
+void
+serv_message(struct Server *server, struct Channel *chan, char *cmd, char *target, char *text, int action) {
+	struct Nick *self;
+	char line[512];
+	char *fmt, *next;
+	long budget;
+	size_t len;
 
-	return ret;
+	assert_warn(server && cmd && target && text,);
+
+	/* ":nick!ident@host cmd target :text\r\n", guessing at the usual
+	 * limits for an ident or host that hasn't been seen yet */
+	self = server->self;
+	budget = 512 - strlen(self->nick) - (self->ident ? strlen(self->ident) : 10) -
+		(self->host ? strlen(self->host) : 63) - strlen(cmd) - strlen(target) -
+		CONSTLEN(":!@   :\r\n");
+	if (action)
+		budget -= CONSTLEN("\001ACTION \001");
+	if (budget < 1)
+		budget = 1;
+
+	fmt = action ? "%s %s :\001ACTION %.*s\001" : "%s %s :%.*s";
+	do {
+		len = strwrap(text, budget, &next);
+		snprintf(line, sizeof(line), fmt, cmd, target, (int)len, text);
+		serv_write(server, Sched_connected, "%s\r\n", line);
+		if (chan)
+			hist_format(chan->history, Activity_self,
+					HIST_SHOW|HIST_LOG|HIST_SELF, "%s", line);
+		text = next;
+	} while (*text);
 }
 
 
@@ -497,59 +1236,170 @@ serv_len(struct Server **head) {
 	return i;
 }
 
-int
-serv_poll(struct Server **head, int timeout) {
-	struct pollfd fds[64];
-	struct Server *sp;
-	int i, ret;
+static void
+serv_linger_free(struct Linger *l) {
+#ifdef TLS
+	if (l->tls_ctx)
+		tls_free(l->tls_ctx);
+#endif /* TLS */
+	shutdown(l->fd, SHUT_RDWR);
+	close(l->fd);
+	pfree(&l->buf);
+	pfree(&l);
+}
+
+/* Hand the connection over to serv_linger() to be closed */
+static void
+serv_linger_add(struct Server *server) {
+	struct Linger *l;
+	struct Output *o;
+	size_t len, off;
+
+	l = emalloc(sizeof(struct Linger));
+	l->fd = server->wfd;
+	l->buf = NULL;
+	l->len = len = 0;
+#ifdef TLS
+	l->tls_ctx = server->tls_ctx;
+	/* without a session there is nothing to write or close */
+	if (server->tls_handshake)
+		goto close;
+	l->len = server->output.tlslen;
+#endif /* TLS */
+	l->len += server->output.len;
 
-	for (i=0, sp = *head; sp; sp = sp->next, i++) {
-		sp->rpollfd->fd = sp->rfd;
-		fds[i].fd = sp->rpollfd->fd;
-		fds[i].events = POLLIN;
+	if (l->len) {
+		l->buf = emalloc(l->len);
+#ifdef TLS
+		memcpy(l->buf, server->output.tls, server->output.tlslen);
+		len = server->output.tlslen;
+#endif /* TLS */
+		for (o = server->output.head, off = server->output.off; o; o = o->next, off = 0) {
+			memcpy(&l->buf[len], &o->msg[off], o->len - off);
+			len += o->len - off;
+		}
 	}
 
-	ret = poll(fds, serv_len(head), timeout);
-	if (errno == EINTR) /* ncurses issue */
-		ret = 0;
+#ifdef TLS
+	if (!l->len && !l->tls_ctx)
+#else
+	if (!l->len)
+#endif /* TLS */
+		goto close;
 
-	for (i=0, sp = *head; sp; sp = sp->next, i++)
-		if (sp->status == ConnStatus_connecting
-				|| sp->status == ConnStatus_connected)
-			sp->rpollfd->revents = fds[i].revents;
+	l->expires = event_now() + LINGER_TIME;
+	if (event_watch(l->fd, EVENT_LINGER) == -1)
+		goto close;
 
-	return ret;
+	l->prev = NULL;
+	l->next = lingering;
+	if (lingering)
+		lingering->prev = l;
+	lingering = l;
+	return;
+
+close:
+	serv_linger_free(l);
+}
+
+/* Continue closing connections that were disconnected: write whatever was
+ * left in their queue (eg, QUIT), and close the TLS session. Gives up
+ * after LINGER_TIME. Returns the number of connections still closing. */
+int
+serv_linger(void) {
+	struct Linger *l, *next;
+	enum EventOpt want;
+	long long now;
+	ssize_t ret;
+	int n = 0;
+
+	for (now = event_now(), l = lingering; l; l = next) {
+		next = l->next;
+		if (now >= l->expires)
+			goto done;
+
+		while (l->len) {
+#ifdef TLS
+			if (l->tls_ctx) {
+				ret = tls_write(l->tls_ctx, l->buf, l->len);
+				if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+					want = ret == TLS_WANT_POLLIN ? EVENT_READ : EVENT_WRITE;
+					goto wait;
+				} else if (ret == -1) {
+					goto done;
+				}
+			} else
+#endif /* TLS */
+			if ((ret = write(l->fd, l->buf, l->len)) == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					goto done;
+				want = EVENT_WRITE;
+				goto wait;
+			}
+			l->len -= ret;
+			memmove(l->buf, &l->buf[ret], l->len);
+		}
+
+#ifdef TLS
+		if (l->tls_ctx) {
+			ret = tls_close(l->tls_ctx);
+			if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+				want = ret == TLS_WANT_POLLIN ? EVENT_READ : EVENT_WRITE;
+				goto wait;
+			}
+		}
+#endif /* TLS */
+
+done:
+		event_del(l->fd);
+		if (l->prev)
+			l->prev->next = l->next;
+		else
+			lingering = l->next;
+		if (l->next)
+			l->next->prev = l->prev;
+		serv_linger_free(l);
+		continue;
+
+wait:
+		event_mod(l->fd, want);
+		event_timer(l->expires - now);
+		n++;
+	}
+	return n;
 }
 
 void
 serv_disconnect(struct Server *server, int reconnect, char *msg) {
 	struct Channel *chan;
-	int ret;
 
 	if (msg)
 		serv_write(server, Sched_now, "QUIT :%s\r\n", msg);
+	dns_cancel(server);
+	serv_connect_abort(server, -1);
+#ifdef IOTHREAD
+	io_stop(server);
+#endif /* IOTHREAD */
+	event_del(server->wfd);
+	if (server->wfd != -1)
+		serv_linger_add(server);
+	serv_output_clear(server);
+	serv_input_reset(&server->input);
 #ifdef TLS
-	if (server->tls) {
-		if (server->tls_ctx) {
-			do {
-				ret = tls_close(server->tls_ctx);
-			} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
-			tls_free(server->tls_ctx);
-		}
-		server->tls_ctx = NULL;
-	} else {
-#endif /* TLS */
-		shutdown(server->rfd, SHUT_RDWR);
-		shutdown(server->wfd, SHUT_RDWR);
-		close(server->rfd);
-		close(server->wfd);
-#ifdef TLS
-	}
+	server->tls_ctx = NULL;
+	server->tls_handshake = server->tls_pollout = server->tls_wpollin = 0;
 #endif /* TLS */
 
-	server->rfd = server->wfd = server->rpollfd->fd = -1;
+	server->rfd = server->wfd = -1;
+	server->revents = 0;
 	server->status = ConnStatus_notconnected;
-	server->lastrecv = server->pingsent = 0;
+	server->lastrecv = server->pingsent = server->connected = 0;
+	server->capneg = server->capreq = server->caps = 0;
+	server->lag.outstanding = 0;
+	server->lag.next = 0;
+	server->lag.last = -1;
 	server->lastconnected = time(NULL);
 	server->reconnect = reconnect;
 
@@ -558,13 +1408,163 @@ serv_disconnect(struct Server *server, int reconnect, char *msg) {
 	 *  - updates the file's mtime, so hist_laodlog knows when we disconnected */
 	hist_format(server->history, Activity_none, HIST_LOG, "SELF_DISCONNECT");
 	for (chan = server->channels; chan; chan = chan->next) {
+		if (!chan->old)
+			chan->rejoin = 1;
+		chan->fetch = Fetch_none;
 		chan_setold(chan, 1);
 		hist_format(chan->history, Activity_none, HIST_LOG, "SELF_DISCONNECT");
 	}
+	serv_join_clear(server, 0);
+	serv_batch_clear(server);
+	expect_clear(server);
 
 	windows[Win_buflist].refresh = 1;
 }
 
+/*
+ * Lag measurement.
+ *
+ * Every lag.interval seconds a PING with a unique token is sent, and the
+ * time until its PONG is recorded. The last LAG_SAMPLES of these are kept,
+ * along with a histogram of them. Buckets are exact below 16ms, and then
+ * split each power of two into 8, so percentiles are within 12.5%.
+ */
+static int
+serv_lag_bucket(long long ms) {
+	int e, i;
+
+	if (ms < 16)
+		return ms < 0 ? 0 : ms;
+	for (e = 4; ms >> (e + 1); e++);
+	i = 16 + (e - 4) * 8 + ((ms >> (e - 3)) & 7);
+	return i < LAG_BUCKETS ? i : LAG_BUCKETS - 1;
+}
+
+/* Highest value that falls into bucket i */
+static long long
+serv_lag_bucket_max(int i) {
+	int e;
+
+	if (i < 16)
+		return i;
+	e = 4 + (i - 16) / 8;
+	return ((8LL + (i - 16) % 8 + 1) << (e - 3)) - 1;
+}
+
+static void
+serv_lag_add(struct Server *server, long long rtt) {
+	struct Lag *lag = &server->lag;
+	long long *slot;
+
+	slot = &lag->samples[lag->count % LAG_SAMPLES];
+	if (lag->count >= LAG_SAMPLES)
+		lag->hist[serv_lag_bucket(*slot)]--;
+	*slot = rtt;
+	lag->hist[serv_lag_bucket(rtt)]++;
+	lag->count++;
+	lag->last = rtt;
+	windows[Win_buflist].refresh = 1;
+}
+
+/* Send a probe if one is due, called from the main loop */
+void
+serv_lag(struct Server *server) {
+	struct Lag *lag = &server->lag;
+	long long now, interval, overdue;
+
+	interval = config_getl("lag.interval") * 1000;
+	if (!interval || server->status != ConnStatus_connected)
+		return;
+
+	now = event_now();
+	if (now >= lag->next) {
+		if (lag->outstanding == LAG_PROBES) {
+			memmove(&lag->probes[0], &lag->probes[1], sizeof(lag->probes[0]) * (LAG_PROBES - 1));
+			lag->outstanding--;
+		}
+		lag->token++;
+		lag->probes[lag->outstanding].token = lag->token;
+		lag->probes[lag->outstanding].sent = now;
+		lag->outstanding++;
+		lag->next = now + interval;
+		serv_write(server, Sched_now, "PING :LAG%lu\r\n", lag->token);
+	}
+	event_timer(lag->next - now);
+
+	/* Once a reply is overdue, the lag shown in the buflist counts up */
+	if (lag->outstanding && (overdue = now - lag->probes[0].sent) >= 1000 && overdue > lag->last) {
+		windows[Win_buflist].refresh = 1;
+		event_timer(1000 - overdue % 1000);
+	}
+}
+
+/* Returns 1 if token is from one of our probes */
+int
+serv_lag_pong(struct Server *server, char *token) {
+	struct Lag *lag = &server->lag;
+	unsigned long t;
+	char *end;
+	int i;
+
+	if (!token || strncmp(token, "LAG", CONSTLEN("LAG")) != 0)
+		return 0;
+	t = strtoul(token + CONSTLEN("LAG"), &end, 10);
+	if (*end || end == token + CONSTLEN("LAG"))
+		return 0;
+
+	for (i = 0; i < lag->outstanding; i++) {
+		if (lag->probes[i].token == t) {
+			serv_lag_add(server, event_now() - lag->probes[i].sent);
+			/* anything older isn't coming back */
+			lag->outstanding -= i + 1;
+			memmove(&lag->probes[0], &lag->probes[i + 1], sizeof(lag->probes[0]) * lag->outstanding);
+			break;
+		}
+	}
+	return 1;
+}
+
+/* Current lag in milliseconds, or -1 if unknown. This is the last RTT,
+ * or how long the oldest probe has been waiting if that is longer. */
+long long
+serv_lag_get(struct Server *server) {
+	long long overdue;
+
+	if (server->status != ConnStatus_connected)
+		return -1;
+	if (server->lag.outstanding) {
+		overdue = event_now() - server->lag.probes[0].sent;
+		if (overdue >= 1000 && overdue > server->lag.last)
+			return overdue;
+	}
+	return server->lag.last;
+}
+
+/* pct'th percentile of recent RTTs (0 and 100 being exact), or -1 */
+long long
+serv_lag_percentile(struct Server *server, int pct) {
+	struct Lag *lag = &server->lag;
+	unsigned long n, want, seen;
+	long long ret;
+	size_t i;
+
+	if ((n = lag->count < LAG_SAMPLES ? lag->count : LAG_SAMPLES) == 0)
+		return -1;
+
+	if (pct <= 0 || pct >= 100) {
+		for (ret = lag->samples[0], i = 1; i < n; i++)
+			if (pct <= 0 ? lag->samples[i] < ret : lag->samples[i] > ret)
+				ret = lag->samples[i];
+		return ret;
+	}
+
+	want = (n * pct + 99) / 100;
+	for (seen = 0, i = 0; i < LAG_BUCKETS; i++)
+		if ((seen += lag->hist[i]) >= want)
+			return serv_lag_bucket_max(i);
+	return -1;
+}
+
 int
 serv_selected(struct Server *server) {
 	if (!selected.channel && selected.server == server)
@@ -583,47 +1583,133 @@ support_get(struct Server *server, char *key) {
 	return NULL;
 }
 
+/* Keep server->isupport up to date with key, just set to value */
+static void
+support_parse(struct Server *server, char *key, char *value) {
+	struct ISupport *is = &server->isupport;
+	char *p, *prefix, type;
+	unsigned char c;
+	size_t i, len;
+
+	if (strcmp(key, "CHANTYPES") == 0) {
+		memset(is->chantypes, 0, sizeof(is->chantypes));
+		for (p = value; p && *p; p++) {
+			c = *p;
+			is->chantypes[c / 8] |= 1 << (c % 8);
+		}
+	} else if (strcmp(key, "PREFIX") == 0 || strcmp(key, "CHANMODES") == 0) {
+		/* a mode in both is a prefix, so both are redone */
+		memset(is->prefixes, 0, sizeof(is->prefixes));
+		memset(is->rank, 0, sizeof(is->rank));
+		memset(is->modeprefix, 0, sizeof(is->modeprefix));
+		memset(is->modetype, 0, sizeof(is->modetype));
+
+		for (p = support_get(server, "CHANMODES"), type = 'A'; p && *p && type <= 'D'; p++) {
+			if (*p == ',')
+				type++;
+			else
+				is->modetype[(unsigned char)*p] = type;
+		}
+
+		if ((p = support_get(server, "PREFIX")) && *p == '(' && (prefix = strchr(p, ')'))) {
+			for (i = 0, p++, prefix++; *p != ')' && *prefix &&
+					i < sizeof(is->prefixes) - 1; i++, p++, prefix++) {
+				is->prefixes[i] = *prefix;
+				is->rank[(unsigned char)*prefix] = i + 1;
+				is->modeprefix[(unsigned char)*p] = *prefix;
+				is->modetype[(unsigned char)*p] = 'P';
+			}
+		}
+	} else if (strcmp(key, "MODES") == 0) {
+		is->modes = value ? atoi(value) : config_getl("def.modes");
+	} else if (strcmp(key, "NICKLEN") == 0) {
+		is->nicklen = value ? atoi(value) : 0;
+	} else if (strcmp(key, "CASEMAPPING") == 0) {
+		if (!value || strcmp(value, "rfc1459") == 0)
+			is->casemap = Casemap_rfc1459;
+		else if (strcmp(value, "strict-rfc1459") == 0)
+			is->casemap = Casemap_strict;
+		else
+			is->casemap = Casemap_ascii;
+	} else if (strcmp(key, "TARGMAX") == 0) {
+		/* TARGMAX=PRIVMSG:4,NOTICE:4,JOIN: */
+		is->targlen = 0;
+		for (p = value; p && *p && is->targlen < SUPPORT_TARGMAX; ) {
+			len = strcspn(p, ":,");
+			if (p[len] == ':' && len < sizeof(is->targmax->cmd)) {
+				memcpy(is->targmax[is->targlen].cmd, p, len);
+				is->targmax[is->targlen].cmd[len] = '\0';
+				is->targmax[is->targlen++].max = strtol(p + len + 1, NULL, 10);
+			}
+			p += strcspn(p, ",");
+			if (*p == ',')
+				p++;
+		}
+	}
+}
+
 void
 support_set(struct Server *server, char *key, char *value) {
-	struct Support *p;
+	struct Support *p, *last = NULL;
 
-	assert_warn(server,);
+	assert_warn(server && key,);
 
-	if (!server->supports) {
-		server->supports = emalloc(sizeof(struct Support));
-		server->supports->prev = server->supports->next = NULL;
-		server->supports->key = key ? strdup(key) : NULL;
-		server->supports->value = value ? strdup(value) : NULL;
-		return;
+	for (p = server->supports; p; last = p, p = p->next)
+		if (strcmp(p->key, key) == 0)
+			break;
+
+	if (p) {
+		pfree(&p->value);
+	} else {
+		p = emalloc(sizeof(struct Support));
+		p->key = estrdup(key);
+		p->prev = last;
+		p->next = NULL;
+		if (last)
+			last->next = p;
+		else
+			server->supports = p;
 	}
+	p->value = value ? estrdup(value) : NULL;
+	support_parse(server, key, value);
+}
 
-	for (p = server->supports; p && p->next; p = p->next) {
-		if (strcmp(p->key, key) == 0) {
-			pfree(&p->value);
-			p->value = strdup(value);
-			return;
-		}
+/* Forget what the server supports, back to the def.* settings */
+void
+support_reset(struct Server *server) {
+	struct Support *p, *next;
+
+	assert_warn(server,);
+
+	for (p = server->supports; p; p = next) {
+		next = p->next;
+		pfree(&p->key);
+		pfree(&p->value);
+		pfree(&p);
 	}
+	server->supports = NULL;
 
-	p->next = emalloc(sizeof(struct Support));
-	p->next->prev = p;
-	p->next->next = NULL;
-	p->next->key = key ? strdup(key) : NULL;
-	p->next->value = value ? strdup(value) : NULL;
+	memset(&server->isupport, 0, sizeof(server->isupport));
+	server->isupport.modes = config_getl("def.modes");
+	support_set(server, "CHANTYPES", config_gets("def.chantypes"));
+	support_set(server, "PREFIX", config_gets("def.prefixes"));
+	support_set(server, "CHANMODES", config_gets("def.chanmodes"));
 }
 
 int
 serv_ischannel(struct Server *server, char *str) {
-	char *chantypes;
+	unsigned char c;
 
 	assert_warn(str && server,0);
 
-	chantypes = support_get(server, "CHANTYPES");
-	if (!chantypes)
-		chantypes = config_gets("def.chantypes");
-	assert(chantypes != NULL);
+	c = *str;
+	return (server->isupport.chantypes[c / 8] >> (c % 8)) & 1;
+}
 
-	return strchr(chantypes, *str) != NULL;
+/* Compare two nicks or channel names, ignoring case as the server does */
+int
+serv_casecmp(struct Server *server, const char *s1, const char *s2) {
+	return strcmp_fold(server ? server->isupport.casemap : Casemap_rfc1459, s1, s2);
 }
 
 void
@@ -659,19 +1745,34 @@ serv_auto_free(struct Server *server) {
 	server->autocmds = NULL;
 }
 
+/* Run autocmds, plan rejoining the channels we were in and fetch what
+ * queries missed. Any /join in autocmds only adds to the plan, so
+ * everything is joined together once serv_join_send() gets to it. */
 void
 serv_auto_send(struct Server *server) {
+	struct Channel *chan;
 	char **p;
 	int save;
 
-	if (!server || !server->autocmds)
+	if (!server)
 		return;
 
-	save = nouich;
-	nouich = 1;
-	for (p = server->autocmds; *p; p++)
-		command_eval(server, *p);
-	nouich = save;
+	if (server->autocmds) {
+		save = nouich;
+		nouich = 1;
+		for (p = server->autocmds; *p; p++)
+			command_eval(server, *p);
+		nouich = save;
+	}
+
+	if (config_getl("rejoin"))
+		for (chan = server->channels; chan; chan = chan->next)
+			if (chan->rejoin)
+				serv_join(server, chan->name, chan->key);
+
+	/* channels catch up once joined, queries have no JOIN to wait for */
+	for (chan = server->queries; chan; chan = chan->next)
+		serv_chathistory(server, chan, Fetch_after, hist_edge(chan->history, 0));
 }
 
 /* check if autocmds has '/join <chan>' */
@@ -689,6 +1790,358 @@ serv_auto_haschannel(struct Server *server, char *chan) {
 	return 0;
 }
 
+/*
+ * Joining channels.
+ *
+ * Channels to join are collected in server->joins by serv_join(), and
+ * serv_join_send() packs them into as few JOIN lines as it can: each has
+ * to fit in 512 bytes and name no more than TARGMAX allows for JOIN, and
+ * no more channels are joined than CHANLIMIT allows. Keys are matched to
+ * channels by position, so keyed channels go first in each line.
+ *
+ * The lines are queued like any other, so serv_pace() spaces them out.
+ * A join stays in the list until the JOIN comes back (serv_join_done()),
+ * which is when its key is kept for rejoining the channel later, or the
+ * server refuses it or forwards us elsewhere (serv_join_failed()).
+ */
+void
+serv_join(struct Server *server, char *name, char *key) {
+	struct Join *j, *p;
+
+	assert_warn(server && name,);
+
+	if (chan_get(&server->channels, name, 0))
+		return;
+
+	for (p = server->joins; p; p = p->next) {
+		if (serv_casecmp(server, p->name, name) == 0) {
+			if (key) {
+				pfree(&p->key);
+				p->key = estrdup(key);
+			}
+			p->sent = 0;
+			return;
+		}
+		if (!p->next)
+			break;
+	}
+
+	j = emalloc(sizeof(struct Join));
+	j->name = estrdup(name);
+	j->key = key ? estrdup(key) : NULL;
+	j->sent = 0;
+	j->next = NULL;
+	j->prev = p;
+	if (p)
+		p->next = j;
+	else
+		server->joins = j;
+}
+
+static void
+serv_join_remove(struct Server *server, struct Join *j) {
+	if (j->prev)
+		j->prev->next = j->next;
+	else
+		server->joins = j->next;
+	if (j->next)
+		j->next->prev = j->prev;
+	pfree(&j->name);
+	pfree(&j->key);
+	pfree(&j);
+}
+
+/* Forget joins that were sent, or all of them */
+void
+serv_join_clear(struct Server *server, int all) {
+	struct Join *j, *next;
+
+	for (j = server->joins; j; j = next) {
+		next = j->next;
+		if (all || j->sent)
+			serv_join_remove(server, j);
+	}
+}
+
+/* We're in chan now: remember the key that got us in */
+void
+serv_join_done(struct Server *server, struct Channel *chan) {
+	struct Join *j;
+
+	assert_warn(server && chan,);
+
+	chan->rejoin = 0;
+	for (j = server->joins; j; j = j->next) {
+		if (serv_casecmp(server, j->name, chan->name) == 0) {
+			if (j->key) {
+				pfree(&chan->key);
+				chan->key = j->key;
+				j->key = NULL;
+			}
+			serv_join_remove(server, j);
+			return;
+		}
+	}
+}
+
+/* The server won't let us into name, or sent us to another channel */
+void
+serv_join_failed(struct Server *server, char *name) {
+	struct Join *j;
+
+	assert_warn(server && name,);
+
+	for (j = server->joins; j; j = j->next) {
+		if (j->sent && serv_casecmp(server, j->name, name) == 0) {
+			serv_join_remove(server, j);
+			return;
+		}
+	}
+}
+
+/* Most channels one JOIN may name, 0 if there is no limit */
+static long
+serv_join_targmax(struct Server *server) {
+	int i;
+
+	for (i = 0; i < server->isupport.targlen; i++)
+		if (strcmp(server->isupport.targmax[i].cmd, "JOIN") == 0)
+			return server->isupport.targmax[i].max;
+	return 0;
+}
+
+/* How many more channels like name can be joined.
+ * CHANLIMIT=#&:50,+:10 limits channels by prefix, MAXCHANNELS=50 is the
+ * older form limiting all of them. Sent joins count as joined. */
+static long
+serv_join_room(struct Server *server, char *name) {
+	struct Channel *chan;
+	struct Join *j;
+	char *p, *prefixes = NULL;
+	size_t len = 0;
+	long limit = LONG_MAX;
+
+	if ((p = support_get(server, "CHANLIMIT")) != NULL) {
+		for (; *p; p += strcspn(p, ",")) {
+			if (*p == ',')
+				p++;
+			len = strcspn(p, ":,");
+			if (p[len] == ':' && memchr(p, *name, len)) {
+				prefixes = p;
+				if (isdigit(p[len + 1]))
+					limit = strtol(p + len + 1, NULL, 10);
+				break;
+			}
+		}
+	} else if ((p = support_get(server, "MAXCHANNELS")) != NULL) {
+		limit = strtol(p, NULL, 10);
+	}
+
+	if (limit == LONG_MAX)
+		return limit;
+
+	for (chan = server->channels; chan; chan = chan->next)
+		if (!chan->old && (!prefixes || memchr(prefixes, *chan->name, len)))
+			limit--;
+	for (j = server->joins; j; j = j->next)
+		if (j->sent && (!prefixes || memchr(prefixes, *j->name, len)))
+			limit--;
+	return limit;
+}
+
+void
+serv_join_send(struct Server *server) {
+	char chans[512], keys[512];
+	struct Join *j, *next;
+	size_t clen, klen, len;
+	long targmax, n;
+	int keyed;
+
+	if (!server || server->status != ConnStatus_connected)
+		return;
+	for (j = server->joins; j && j->sent; j = j->next);
+	if (!j)
+		return;
+
+	targmax = serv_join_targmax(server);
+	do {
+		clen = klen = n = 0;
+		for (keyed = 1; keyed >= 0; keyed--) {
+			for (j = server->joins; j && (!targmax || n < targmax); j = next) {
+				next = j->next;
+				if (j->sent || !!j->key != keyed)
+					continue;
+				if (serv_join_room(server, j->name) <= 0) {
+					hist_format(server->history, Activity_error, HIST_SHOW,
+							"SELF_CHANLIMIT %s %s", server->name, j->name);
+					serv_join_remove(server, j);
+					continue;
+				}
+
+				/* "JOIN " chans [" " keys] "\r\n", 512 bytes at most */
+				len = CONSTLEN("JOIN ") + clen + !!clen + strlen(j->name) +
+					(j->key ? klen + 1 + strlen(j->key) : klen ? klen + 1 : 0) +
+					CONSTLEN("\r\n");
+				if (len > sizeof(chans)) {
+					if (n)
+						continue;
+					ui_error("channel name too long to join: %s", j->name);
+					serv_join_remove(server, j);
+					continue;
+				}
+
+				clen += snprintf(chans + clen, sizeof(chans) - clen,
+						"%s%s", clen ? "," : "", j->name);
+				if (j->key)
+					klen += snprintf(keys + klen, sizeof(keys) - klen,
+							"%s%s", klen ? "," : "", j->key);
+				j->sent = 1;
+				n++;
+			}
+		}
+
+		if (klen)
+			serv_write(server, Sched_now, "JOIN %s %s\r\n", chans, keys);
+		else if (clen)
+			serv_write(server, Sched_now, "JOIN %s\r\n", chans);
+	} while (n);
+}
+
+/*
+ * Ask for a page of a channel's history from the server: messages since
+ * from (or the latest if it's NULL) or, going back, from before it. The
+ * reply is a chathistory batch, see handle_chathistory(), or if there
+ * is nothing to send a FAIL or lone ACK, see serv_chathistory_done().
+ * One request per channel is made at a time, so pages only follow as
+ * they're needed.
+ */
+void
+serv_chathistory(struct Server *server, struct Channel *chan, enum Fetch fetch, struct History *from) {
+	char ref[160], id[128];
+	struct tm tm;
+	long limit, max;
+	char *p;
+
+	if (!server || !chan || !(server->caps & Cap_chathistory) ||
+			server->status != ConnStatus_connected || chan->fetch ||
+			(fetch == Fetch_before && (chan->fetchedall || !from)))
+		return;
+
+	limit = config_getl("chathistory.page");
+	if ((p = support_get(server, "CHATHISTORY")) && (max = strtol(p, NULL, 10)) > 0 && max < limit)
+		limit = max;
+
+	if (!from) {
+		snprintf(ref, sizeof(ref), "*");
+	} else if (tag_gets(from->tags, "msgid", id, sizeof(id))) {
+		snprintf(ref, sizeof(ref), "msgid=%s", id);
+	} else {
+		gmtime_r(&from->timestamp, &tm);
+		strftime(ref, sizeof(ref), "timestamp=%Y-%m-%dT%H:%M:%S.000Z", &tm);
+	}
+
+	chan->fetch = from ? fetch : Fetch_latest;
+	serv_request(server, Sched_now, Expect_chathistory, chan->name,
+			"CHATHISTORY %s %s %s %ld\r\n",
+			chan->fetch == Fetch_before ? "BEFORE" :
+			chan->fetch == Fetch_after ? "AFTER" : "LATEST",
+			chan->name, ref, limit);
+}
+
+/* No chathistory batch is coming for target, or
+ * for any buffer if it's NULL. Was it waiting? */
+int
+serv_chathistory_done(struct Server *server, char *target) {
+	struct Channel *lists[2], *chan;
+	int i, ret = 0;
+
+	lists[0] = server->channels;
+	lists[1] = server->queries;
+	for (i = 0; i < 2; i++) {
+		for (chan = lists[i]; chan; chan = chan->next) {
+			if (chan->fetch && (!target || serv_casecmp(server, chan->name, target) == 0)) {
+				chan->fetch = Fetch_none;
+				ret = 1;
+			}
+		}
+	}
+	return ret;
+}
+
+/* Start holding messages tagged batch=ref */
+struct Batch *
+serv_batch_open(struct Server *server, char *ref, char *type, char **params, time_t timestamp) {
+	struct Batch *b;
+
+	assert_warn(server && ref && type, NULL);
+
+	b = emalloc(sizeof(struct Batch));
+	b->ref = estrdup(ref);
+	b->type = estrdup(type);
+	b->params = param_dup(params);
+	b->timestamp = timestamp;
+	b->msgs = b->last = NULL;
+	b->expires = 0;
+	b->nicks = NULL;
+	b->len = 0;
+	b->prev = NULL;
+	b->next = server->batches;
+	if (server->batches)
+		server->batches->prev = b;
+	server->batches = b;
+	return b;
+}
+
+struct Batch *
+serv_batch_get(struct Server *server, char *ref) {
+	struct Batch *b;
+
+	for (b = server->batches; ref && b; b = b->next)
+		if (strcmp(b->ref, ref) == 0)
+			return b;
+	return NULL;
+}
+
+void
+serv_batch_add(struct Batch *batch, struct History *msg) {
+	msg->prev = batch->last;
+	msg->next = NULL;
+	if (batch->last)
+		batch->last->next = msg;
+	else
+		batch->msgs = msg;
+	batch->last = msg;
+}
+
+void
+serv_batch_close(struct Server *server, struct Batch *batch) {
+	struct History *p, *next;
+
+	if (batch->prev)
+		batch->prev->next = batch->next;
+	else
+		server->batches = batch->next;
+	if (batch->next)
+		batch->next->prev = batch->prev;
+
+	for (p = batch->msgs; p; p = next) {
+		next = p->next;
+		hist_free(p);
+	}
+	param_free(batch->params);
+	pfree(&batch->nicks);
+	pfree(&batch->ref);
+	pfree(&batch->type);
+	pfree(&batch);
+}
+
+/* Drop batches that never ended */
+void
+serv_batch_clear(struct Server *server) {
+	while (server->batches)
+		serv_batch_close(server, server->batches);
+}
+
 void
 schedule(struct Server *server, enum Sched when, char *msg) {
 	struct Schedule *p;
@@ -750,3 +2203,122 @@ expect_get(struct Server *server, enum Expect cmd) {
 	else
 		return server->expect[cmd];
 }
+
+/*
+ * Send a request that replies are expected to. With labeled-response,
+ * it's labeled and the replies come back with that label (or in a
+ * batch with it), so any number can be waiting at once. Otherwise
+ * there is only expect_set()'s one slot per kind of reply.
+ */
+int
+serv_request(struct Server *server, enum Sched when, enum Expect cmd, char *about, char *format, ...) {
+	struct Label *l;
+	char msg[512 + 1];
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = vsnprintf(msg, sizeof(msg), format, ap);
+	va_end(ap);
+
+	assert_warn(ret >= 0 && (size_t)ret < sizeof(msg), -1);
+
+	if (!(server->caps & Cap_labeledresponse) || nouich) {
+		expect_set(server, cmd, about);
+		return serv_write(server, when, "%s", msg);
+	}
+
+	l = emalloc(sizeof(struct Label));
+	l->label = smprintf(24, "%lu", ++server->labelid);
+	l->batch = NULL;
+	l->cmd = cmd;
+	l->about = about ? estrdup(about) : NULL;
+	l->prev = NULL;
+	l->next = server->labels;
+	if (server->labels)
+		server->labels->prev = l;
+	server->labels = l;
+
+	return serv_write(server, when, "@label=%s %s", l->label, msg);
+}
+
+/* The request replied to by a message with these tags, which has
+ * its label, or is in a batch that has. Or by the batch ref. */
+static struct Label *
+expect_label(struct Server *server, char *tags, char *ref) {
+	struct Label *l;
+	char buf[64];
+
+	if (!server->labels)
+		return NULL;
+	if (tag_gets(tags, "label", buf, sizeof(buf))) {
+		for (l = server->labels; l; l = l->next)
+			if (strcmp(l->label, buf) == 0)
+				return l;
+		return NULL;
+	}
+	if (!ref && !(ref = tag_gets(tags, "batch", buf, sizeof(buf))))
+		return NULL;
+	for (l = server->labels; l; l = l->next)
+		if (l->batch && strcmp(l->batch, ref) == 0)
+			return l;
+	return NULL;
+}
+
+/* What msg is a reply about: the labeled request's,
+ * or failing that the guess expect_get() makes */
+char *
+expect_msg(struct Server *server, struct History *msg, enum Expect cmd) {
+	struct Label *l;
+
+	if ((l = expect_label(server, msg->tags, NULL)))
+		return l->about;
+	return expect_get(server, cmd);
+}
+
+/* Replies to the request labeled in tags will be in batch ref */
+void
+expect_batch(struct Server *server, char *tags, char *ref) {
+	struct Label *l;
+
+	if ((l = expect_label(server, tags, NULL))) {
+		pfree(&l->batch);
+		l->batch = estrdup(ref);
+	}
+}
+
+static void
+expect_remove(struct Server *server, struct Label *l) {
+	if (l->prev)
+		l->prev->next = l->next;
+	else
+		server->labels = l->next;
+	if (l->next)
+		l->next->prev = l->prev;
+	pfree(&l->label);
+	pfree(&l->batch);
+	pfree(&l->about);
+	pfree(&l);
+}
+
+/* The reply labeled in tags, or batch ref of replies,
+ * to a request has been handled: that was all of them */
+void
+expect_done(struct Server *server, char *tags, char *ref) {
+	struct Label *l;
+
+	if ((l = expect_label(server, tags, ref))) {
+		/* a batch of history was seen by handle_chathistory(),
+		 * anything else (ACK, FAIL) means there's none */
+		if (l->cmd == Expect_chathistory && !l->batch)
+			serv_chathistory_done(server, l->about);
+		expect_remove(server, l);
+	}
+}
+
+/* Forget labeled requests: their replies won't come now */
+void
+expect_clear(struct Server *server) {
+	while (server->labels)
+		expect_remove(server, server->labels);
+}
@@ -17,6 +17,7 @@
  *
  */
 
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -75,6 +76,58 @@ strcmp_n(const char *s1, const char *s2) {
 		return strcmp(s1, s2);
 }
 
+/* What each byte folds to under each CASEMAPPING */
+static unsigned char *
+strfold_table(enum Casemap map) {
+	static unsigned char tables[Casemap_last][UCHAR_MAX + 1];
+	static int filled = 0;
+	int i, m;
+
+	if (!filled) {
+		for (m = 0; m < Casemap_last; m++) {
+			for (i = 0; i <= UCHAR_MAX; i++)
+				tables[m][i] = i >= 'A' && i <= 'Z' ? i - 'A' + 'a' : i;
+			if (m == Casemap_ascii)
+				continue;
+			/* {}| are the lowercase of []\, and ~ of ^ unless strict */
+			tables[m]['['] = '{';
+			tables[m][']'] = '}';
+			tables[m]['\\'] = '|';
+			if (m == Casemap_rfc1459)
+				tables[m]['^'] = '~';
+		}
+		filled = 1;
+	}
+	return tables[map];
+}
+
+/* strcmp_n() ignoring case as map has it */
+int
+strcmp_fold(enum Casemap map, const char *s1, const char *s2) {
+	unsigned char *fold;
+
+	if (!s1 || !s2)
+		return strcmp_n(s1, s2);
+
+	fold = strfold_table(map);
+	for (; fold[(unsigned char)*s1] == fold[(unsigned char)*s2]; s1++, s2++)
+		if (!*s1)
+			return 0;
+	return fold[(unsigned char)*s1] - fold[(unsigned char)*s2];
+}
+
+/* Hash of str that is the same for any case of it, as map has it */
+unsigned long long
+strhash_fold(enum Casemap map, const char *str) {
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned char *fold;
+
+	fold = strfold_table(map);
+	for (; str && *str; str++)
+		hash = (hash ^ fold[(unsigned char)*str]) * 1099511628211ULL;
+	return hash;
+}
+
 char *
 struntil(char *str, char until) {
 	static char ret[1024];
@@ -117,6 +170,61 @@ strntok(char *str, char *sep, int n) {
 	return NULL;
 }
 
+/* Bytes in the character at str, taking a mIRC colour code
+ * (^C[fg[,bg]]) as one character */
+static size_t
+strcharlen(char *str) {
+	unsigned char c = *str;
+	size_t len, i;
+
+	if (c == 3) {
+		for (len = 1; len < 3 && isdigit((unsigned char)str[len]); len++);
+		if (len > 1 && str[len] == ',' && isdigit((unsigned char)str[len + 1]))
+			for (i = len++; len < i + 3 && isdigit((unsigned char)str[len]); len++);
+		return len;
+	}
+
+	if (c < 0xc0)
+		return 1;
+	len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+	for (i = 1; i < len; i++)
+		if ((str[i] & 0xc0) != 0x80)
+			return i;
+	return len;
+}
+
+/*
+ * Length of the first line of str that fits in max bytes. It is broken
+ * at the last space that fits, or failing that, between two characters:
+ * never in a UTF-8 sequence or colour code. *next is set to the rest,
+ * without the space. At least one character is taken, however long.
+ */
+size_t
+strwrap(char *str, size_t max, char **next) {
+	size_t i, len = 0, space = 0;
+
+	for (i = 0; str[i]; i += len) {
+		if (str[i] == ' ' && i)
+			space = i;
+		len = strcharlen(&str[i]);
+		if (i + len > max)
+			break;
+	}
+
+	if (!str[i]) {
+		*next = &str[i];
+		return i;
+	} else if (space) {
+		*next = &str[space + 1];
+		return space;
+	} else {
+		if (!i)
+			i = len;
+		*next = &str[i];
+		return i;
+	}
+}
+
 #define S_YEAR	31557600 /* 60*60*24*365.25 */
 #define S_MONTH	2629800  /* 60*60*24*(365.25 / 12) */
 #define S_WEEK	604800   /* 60*60*24*7 */
@@ -22,11 +22,11 @@
 
 #include <time.h>
 #include <sys/time.h>
-#include <poll.h>
 
 struct Nick {
 	struct Nick *prev;
 	char priv;    /* [~&@%+ ] */
+	char privs[8]; /* every one of [~&@%+] held, highest first */
 	char *prefix;
 	char *nick;
 	char *ident;
@@ -74,6 +74,7 @@ struct History {
 	enum Activity activity;
 	enum HistOpt options;
 	char *raw;
+	char *tags;     /* IRCv3 message tags without the '@', see tag_get() */
 	char **_params; /* contains all params, free from here */
 	char **params;  /* contains params without perfix, don't free */
 	char *format;   /* cached format */
@@ -83,29 +84,64 @@ struct History {
 	struct History *next;
 };
 
+#define HIST_SEEN 512 /* fingerprints per set, so 512-1024 are remembered */
+
+/* Fingerprints of a buffer's messages, see hist_seen() */
+struct HistSeen {
+	unsigned long long set[2][HIST_SEEN * 2];
+	int cur; /* set being added to, the other is older */
+	int len; /* in set[cur] */
+};
+
 struct HistInfo {
 	enum Activity activity;
 	int unread;
 	int ignored;
 	struct Server *server;
 	struct Channel *channel;
-	struct History *history;
+	struct History *history; /* newest first */
+	struct History *oldest;
+	struct History *placed;  /* last entry inserted behind the head */
+	int len;
+	struct HistSeen *seen;
+};
+
+enum Fetch {
+	Fetch_none,
+	Fetch_latest,
+	Fetch_after,
+	Fetch_before,
 };
 
 struct Channel {
 	struct Channel *prev;
 	int old; /* are we actually in this channel,
 		    or just keeping it for memory */
+	int rejoin; /* were in it when disconnected */
 	char *name;
+	char *key;  /* given when it was joined */
 	char *mode;
 	char *topic;
 	int query;
+	enum Fetch fetch; /* CHATHISTORY request waiting */
+	int fetchedall;   /* nothing older to fetch */
 	struct Nick *nicks;
 	struct HistInfo *history;
 	struct Server *server;
 	struct Channel *next;
 };
 
+/* IRCv3 capabilities hirc asks for, see handle_CAP() */
+enum Cap {
+	Cap_multiprefix		= 1 << 0, /* all prefixes in NAMES */
+	Cap_userhostinnames	= 1 << 1, /* nick!user@host in NAMES */
+	Cap_messagetags		= 1 << 2, /* any tags, see tag_get() */
+	Cap_servertime		= 1 << 3, /* time tag, see tag_time() */
+	Cap_batch		= 1 << 4, /* netsplits in one go, see handle_BATCH() */
+	Cap_labeledresponse	= 1 << 5, /* replies matched to requests, see serv_request() */
+	Cap_chathistory		= 1 << 6, /* fetch what was missed, see serv_chathistory() */
+};
+
 enum ConnStatus {
 	ConnStatus_notconnected,
 	ConnStatus_connecting,
@@ -120,6 +156,32 @@ struct Support {
 	struct Support *next;
 };
 
+enum Casemap {
+	Casemap_rfc1459, /* a-z, {}|^ and [] \\ ~ are the same case */
+	Casemap_strict,  /* strict-rfc1459, without ^ and ~ */
+	Casemap_ascii,   /* only a-z */
+	Casemap_last,
+};
+
+/* What is looked up often in RPL_ISUPPORT, kept parsed by support_set().
+ * Tables are indexed by an unsigned char. */
+#define SUPPORT_TARGMAX 16
+struct ISupport {
+	unsigned char chantypes[256 / 8]; /* bitmap of CHANTYPES */
+	char prefixes[8];     /* symbols in PREFIX=(ov)@+, highest first */
+	char rank[256];       /* of a symbol, 1 for the highest, 0 if not one */
+	char modeprefix[256]; /* symbol for a mode, '\0' if none */
+	char modetype[256];   /* 'A'-'D' by CHANMODES, 'P' for PREFIX, 0 if unknown */
+	int modes;            /* MODES, modes with an argument per MODE */
+	int nicklen;          /* NICKLEN, 0 if unknown */
+	enum Casemap casemap; /* CASEMAPPING */
+	struct {
+		char cmd[16];
+		long max; /* 0 if unlimited */
+	} targmax[SUPPORT_TARGMAX];
+	int targlen;
+};
+
 enum Expect {
 	/*
 	 * The expect system is how a command or handler is able to change the
@@ -152,6 +214,7 @@ enum Expect {
 	Expect_nicknameinuse,
 	Expect_nosuchnick, /* currently set by commands that send MODE
 			      and subsequently unset by handle_mode */
+	Expect_chathistory, /* labeled CHATHISTORY, see expect_done() */
 	Expect_last,
 };
 
@@ -167,16 +230,120 @@ struct Schedule {
 	struct Schedule *next;
 };
 
+/* A channel to join, see serv_join() */
+struct Join {
+	struct Join *prev;
+	char *name;
+	char *key;
+	int sent; /* waiting for the JOIN to come back */
+	struct Join *next;
+};
+
+/* An IRCv3 BATCH being held until it ends, see serv_batch_open() */
+struct Batch {
+	struct Batch *prev;
+	char *ref;
+	char *type;           /* netsplit or netjoin */
+	char **params;        /* after the type */
+	time_t timestamp;
+	struct History *msgs; /* oldest first */
+	struct History *last;
+	time_t expires;       /* guessed from QUITs, see handle_batch_expire() */
+	char **nicks;         /* sorted, of a guessed netsplit that's been dealt with */
+	size_t len;
+	struct Batch *next;
+};
+
+/* A request sent with a label, see serv_request() */
+struct Label {
+	struct Label *prev;
+	char *label;
+	char *batch;  /* ref of the labeled-response batch of replies */
+	enum Expect cmd;
+	char *about;
+	struct Label *next;
+};
+
+/* Lines read from a server, see serv_input_line() */
+struct Input {
+	char *buf;    /* ring of INPUT_BUF bytes, then room to unwrap a line */
+	size_t head;  /* start of the first unhandled line */
+	size_t len;   /* bytes after head */
+	size_t scan;  /* bytes after head already searched for "\n" */
+	int discard;  /* line too long: drop up to the next "\n" */
+	int more;     /* ran out of budget, call serv_read() again */
+};
+
+enum Priority {
+	Prio_urgent, /* PONG, QUIT, registration: never held back */
+	Prio_normal, /* PRIVMSG and most else */
+	Prio_bulk,   /* queries: NAMES, WHO, MODE <target>, ... */
+	Prio_last,
+};
+
+struct Output {
+	struct Output *prev;
+	char *msg; /* not nul-terminated */
+	size_t len;
+	int delayed; /* held back by serv_pace() */
+	struct Output *next;
+};
+
+/* RTT measurement with PING, see serv_lag() */
+#define LAG_PROBES 8    /* outstanding at once */
+#define LAG_SAMPLES 128 /* kept for the histogram */
+#define LAG_BUCKETS 160 /* 8 per power of two, up to an hour */
+struct Lag {
+	struct {
+		unsigned long token;
+		long long sent;     /* event_now() */
+	} probes[LAG_PROBES];   /* waiting for a PONG, oldest first */
+	int outstanding;
+	unsigned long token;    /* last one sent */
+	long long next;         /* when to send the next probe */
+	long long last;         /* last RTT measured, -1 if none */
+	long long samples[LAG_SAMPLES]; /* ring of the last RTTs */
+	unsigned long count;    /* RTTs measured in total */
+	unsigned short hist[LAG_BUCKETS]; /* samples in each bucket */
+};
+
 struct Server {
 	struct Server *prev;
 	int wfd;
 	int rfd;
+	struct Input input;
 	struct {
-		char *buf;
-		size_t size;
-		size_t pos;
-	} input;
-	struct pollfd *rpollfd;
+		struct {
+			struct Output *head;
+			struct Output *tail;
+			int lines;
+		} queue[Prio_last]; /* waiting on flood control */
+		long long flood;    /* see serv_pace() */
+		unsigned long sent;    /* lines let through by serv_pace() */
+		unsigned long delayed; /* lines that had to wait */
+		struct Output *head;   /* being written */
+		struct Output *tail;
+		size_t off;   /* bytes of head already written */
+		size_t len;   /* bytes queued */
+		int lines;    /* lines queued */
+#ifdef TLS
+		char *tls;    /* taken from the queue for tls_write() */
+		size_t tlslen;
+#endif /* TLS */
+	} output; /* see serv_flush() */
+	struct {
+		struct DNSCache *dns;    /* result of dns_lookup() */
+		struct addrinfo **addrs; /* dns->ai, in the order to try (RFC 8305) */
+		int *fds;                /* socket for each of addrs, or -1 */
+		int len;                 /* number of addrs, 0 if not connecting */
+		int next;                /* index of the next address to try */
+		long long last;          /* when the last attempt started, event_now() */
+		int error;               /* errno of the last failed attempt */
+	} conn;
+#ifdef IOTHREAD
+	struct IOThread *io; /* NULL unless the connection is handled by a thread */
+#endif /* IOTHREAD */
+	int revents; /* EVENT_READ|EVENT_WRITE, set by event_wait() */
 	enum ConnStatus status;
 	char *name;
 	char *username;
@@ -185,26 +352,136 @@ struct Server {
 	char *host;
 	char *port;
 	struct Support *supports;
+	struct ISupport isupport;
 	struct Nick *self;
 	struct HistInfo *history;
 	struct Channel *channels;
 	struct Channel *queries;
 	struct Schedule *schedule;
+	struct Join *joins;
+	struct Batch *batches;
+	struct Label *labels;
+	unsigned long labelid; /* last label used */
+	int capneg;  /* CAP END hasn't been sent yet */
+	int capreq;  /* enum Cap: waiting on ACK or NAK */
+	int caps;    /* enum Cap: enabled */
 	int reconnect;
 	char *expect[Expect_last];
 	char **autocmds;
 	int connectfail; /* number of failed connections */
 	time_t lastconnected; /* last time a connection was lost */
+	time_t connected; /* when registration finished, 0 until then */
 	time_t lastrecv; /* last time a message was received from server */
 	time_t pingsent; /* last time a ping was sent to server */
+	struct Lag lag;
 #ifdef TLS
 	int tls;
 	int tls_verify;
 	struct tls *tls_ctx;
+	int tls_handshake; /* tls_handshake() hasn't finished */
+	int tls_pollout;   /* libtls returned TLS_WANT_POLLOUT */
+	int tls_wpollin;   /* tls_write() returned TLS_WANT_POLLIN */
+	int tls_session;   /* fd libtls keeps the session to resume in */
+	unsigned long tls_resumed, tls_full;
 #endif /* TLS */
 	struct Server *next;
 };
 
+enum EventOpt {
+	/* R - set in struct Server.revents for a server's fd
+	 * W - returned by event_wait() */
+	EVENT_READ   = 1,  /* [R] fd is readable (or hung up) */
+	EVENT_WRITE  = 2,  /* [R] fd is writable */
+	EVENT_INPUT  = 4,  /* [W] stdin is readable */
+	EVENT_RESIZE = 8,  /* [W] SIGWINCH received */
+	EVENT_TIMER  = 16, /* [W] timeout requested with event_timer() */
+	EVENT_DNS    = 32, /* [W] a lookup finished, see dns_read() */
+	EVENT_LINGER = 64, /* [W] a closing connection is ready, see serv_linger() */
+};
+
+struct Event {
+	struct Event *prev;
+	int fd;
+	enum EventOpt want; /* EVENT_READ|EVENT_WRITE */
+	enum EventOpt flag; /* returned by event_wait() if server is NULL */
+	struct Server *server;
+	struct Event *next;
+};
+
+struct Linger {
+	struct Linger *prev;
+	int fd;
+#ifdef TLS
+	struct tls *tls_ctx;
+#endif /* TLS */
+	char *buf;          /* output left to write */
+	size_t len;
+	long long expires;  /* event_now() */
+	struct Linger *next;
+};
+
+struct Lookup {
+	struct Lookup *prev;
+	char *host;
+	char *port;
+	struct Server *server; /* NULL if cancelled */
+	int running;           /* resolving in a thread, otherwise waiting on one */
+	int ret;               /* getaddrinfo() return value */
+	struct addrinfo *ai;
+	struct Lookup *next;
+};
+
+struct DNSCache {
+	struct DNSCache *prev;
+	char *host;
+	char *port;
+	struct addrinfo *ai;
+	time_t expires;
+	int refs;              /* servers still using ai */
+	struct DNSCache *next;
+};
+
+#ifdef IOTHREAD
+#include <pthread.h>
+#include <stdatomic.h>
+/* Single-producer single-consumer queue, see io.c */
+struct IOQueue {
+	void **items;
+	atomic_size_t head; /* next to pop, only moved by the consumer */
+	atomic_size_t tail; /* next to push, only moved by the producer */
+};
+
+struct IOThread {
+	pthread_t thread;
+	int fd;
+#ifdef TLS
+	struct tls *tls_ctx;
+#endif /* TLS */
+	int notify[2];       /* thread -> main: lines in .in, or closed */
+	int wake[2];         /* main -> thread: lines in .out, or stop */
+	struct IOQueue in;   /* lines read, malloc'd strings */
+	struct IOQueue out;  /* lines to write, struct Output */
+	atomic_int stop;     /* set by io_stop() */
+	atomic_int closed;   /* set by the thread when the connection is lost */
+	atomic_int blocked;  /* thread is waiting for room in .in */
+	atomic_int dropped;  /* lines too long to pass on */
+	char *error;         /* why the connection was lost, once closed */
+	/* only touched by the thread until it exits */
+	struct Input input;
+	char *buf;           /* being written */
+	size_t len;
+};
+#endif /* IOTHREAD */
+
+/* One of a message's IRCv3 tags, pointing into the line it came from.
+ * The value is still escaped, see tag_value() */
+struct Tag {
+	char *key;
+	size_t keylen;
+	char *value;  /* NULL if the tag has no value */
+	size_t len;
+};
+
 /* messages received from server */
 struct Handler {
 	char *cmd; /* or numeric */
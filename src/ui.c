@@ -25,7 +25,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <locale.h>
+#include <unistd.h>
 #include <ncurses.h>
+#include <sys/ioctl.h>
 #ifdef TLS
 #include <tls.h>
 #endif /* TLS */
@@ -303,6 +305,16 @@ ui_read(void) {
 	}
 }
 
+/* Called on SIGWINCH when ncurses doesn't get to handle it (see event.c) */
+void
+ui_resize(void) {
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+		resizeterm(ws.ws_row, ws.ws_col);
+	uineedredraw = 1;
+}
+
 void
 ui_redraw(void) {
 	struct History *p;
@@ -542,6 +554,8 @@ ui_draw_buflist(void) {
 	int i = 1, scroll;
 	char *actind[Activity_last];
 	char *oldind, *indicator;
+	char lagstr[64];
+	long long lag;
 
 	oldind = estrdup(format(NULL, config_gets("format.ui.buflist.old"), NULL));
 	actind[Activity_none] = estrdup(format(NULL, config_gets("format.ui.buflist.activity.none"), NULL));
@@ -575,7 +589,16 @@ ui_draw_buflist(void) {
 			if (selected.server == sp && !selected.channel)
 				wattron(windows[Win_buflist].window, A_BOLD);
 			indicator = (sp->status == ConnStatus_notconnected) ? oldind : actind[sp->history->activity];
-			ui_wprintc(&windows[Win_buflist], 1, "%02d: %s─ %s%s\n", i, sp->next ? "├" : "└", indicator, sp->name);
+			if ((lag = serv_lag_get(sp)) == -1)
+				*lagstr = '\0';
+			else if (lag < 1000)
+				snprintf(lagstr, sizeof(lagstr), " %s%lldms",
+						format(NULL, config_gets("format.ui.buflist.lag"), NULL), lag);
+			else
+				snprintf(lagstr, sizeof(lagstr), " %s%lld.%llds",
+						format(NULL, config_gets("format.ui.buflist.lag"), NULL),
+						lag / 1000, lag % 1000 / 100);
+			ui_wprintc(&windows[Win_buflist], 1, "%02d: %s─ %s%s%s\n", i, sp->next ? "├" : "└", indicator, sp->name, lagstr);
 			wattrset(windows[Win_buflist].window, A_NORMAL);
 		}
 		i++;
@@ -838,6 +861,10 @@ ui_draw_main(void) {
 		ui_wprintc(&windows[Win_main], 0, "%s\n", hp->format);
 	}
 
+	/* scrolled up past the oldest line: the server may have more */
+	if (!hp && windows[Win_main].scroll > 0 && selected.channel)
+		serv_chathistory(selected.server, selected.channel, Fetch_before, hist_edge(selected.history, 1));
+
 	if (selected.channel && selected.channel->topic) {
 		wmove(windows[Win_main].window, 0, 0);
 		ui_wprintc(&windows[Win_main], 0, "%s\n", format(&windows[Win_main], config_gets("format.ui.topic"), NULL));
@@ -860,12 +887,6 @@ ui_select(struct Server *server, struct Channel *channel) {
 	selected.showign  = 0;
 
 	if (selected.history->unread || selected.history->ignored) {
-		for (i = 0, hp = selected.history->history; hp && hp->next; hp = hp->next, i++);
-		if (i == (HIST_MAX-1)) {
-			pfree(&hp->next);
-			hp->next = NULL;
-		}
-
 		total = selected.history->unread + selected.history->ignored;
 
 		for (i = 0, hp = selected.history->history; hp && hp->next && i < total; hp = hp->next)
@@ -875,11 +896,7 @@ ui_select(struct Server *server, struct Channel *channel) {
 			ind = hist_format(NULL, Activity_none, HIST_SHOW|HIST_TMP, "SELF_UNREAD %d %d :unread, ignored",
 					selected.history->unread, selected.history->ignored);
 			ind->origin = selected.history;
-			ind->next = hp;
-			ind->prev = hp->prev;
-			if (hp->prev)
-				hp->prev->next = ind;
-			hp->prev = ind;
+			hist_link(selected.history, ind, hp->prev);
 		}
 	}
 